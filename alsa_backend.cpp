@@ -0,0 +1,431 @@
+/** @file
+ * @addtogroup backend Audio Backends
+ *
+ * @{
+ *
+ * @brief This file contains the direct ALSA backend, which runs the process callback
+ * straight off the sound card's mmap buffers with no JACK server in between. Details
+ * follow.
+ *
+ * The capture and playback streams of one device are opened in mmap interleaved mode and
+ * linked so they start together. The audio thread waits on the capture stream, converts
+ * the capture channels to one float buffer per channel, calls the process callback, and
+ * writes its output back to the playback channels. If the card has fewer capture
+ * channels than the pedal, the last one is repeated. Any extra playback channels repeat
+ * the pedal's last channel, so a mono pedal still plays on both sides of a stereo card. Float, 32 bit and 16 bit integer sample formats are tried in
+ * that order. Playback is primed with silence so the output always runs a fixed number of
+ * periods behind the input. The audio thread asks for SCHED_FIFO priority
+ * ALSA_THREAD_PRIORITY, the same as a typical JACK server's, so it runs above the IRQ
+ * threads without shutting out the kernel's own. If it cannot get it, it still runs,
+ * but prints a warning.
+ */
+#pragma once
+
+#ifndef ALSA_BACKEND_CPP_
+#define ALSA_BACKEND_CPP_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <cstring>
+#include <pthread.h>
+#include <sched.h>
+#include <atomic>
+#include <alsa/asoundlib.h>
+#include <jack/jack.h>
+
+#include "audio_backend.cpp"
+
+#define ALSA_PERIODS 2 ///< Number of periods in the hardware buffer
+#define ALSA_THREAD_PRIORITY 70 ///< SCHED_FIFO priority of the audio thread
+
+class Alsa_Backend : public Audio_Backend
+{
+	public:
+		int open(const char *name);
+		int start(Audio_Process_Callback callback, void *arg);
+		void stop(void);
+		jack_nframes_t sampleRate(void);
+		jack_nframes_t bufferSize(void);
+		int channels(void) { return _channels; }
+		int realtimePriority(void) { return ALSA_THREAD_PRIORITY; }
+		void onXrun(Audio_Xrun_Callback callback, void *arg);
+
+		/** Set up an ALSA backend.
+		 *
+		 * @param sample_rate The requested rate; the nearest rate the card supports is used
+		 * @param buffer_size The requested period size; the nearest the card supports is used
+		 * @param channels Number of channels passed to the process callback
+		 */
+		Alsa_Backend(jack_nframes_t sample_rate, jack_nframes_t buffer_size, int channels = 1);
+		~Alsa_Backend();
+
+	private:
+		int configure(snd_pcm_t *pcm, unsigned int *channels);
+		int recover(int err);
+		int readPeriod(void);
+		int writePeriod(void);
+		float decodeSample(const uint8_t *frame, unsigned int channel);
+		void encodeSample(uint8_t *frame, unsigned int channel, float sample);
+		static void *audioThread(void *arg);
+
+		snd_pcm_t *_capture;
+		snd_pcm_t *_playback;
+		snd_pcm_format_t _format;
+		unsigned int _capture_channels;
+		unsigned int _playback_channels;
+
+		jack_nframes_t _sample_rate;
+		jack_nframes_t _buffer_size;
+
+		int _channels;
+		jack_default_audio_sample_t *_in; // _buffer_size samples per channel, one channel after another
+		jack_default_audio_sample_t *_out;
+		jack_default_audio_sample_t **_in_channels; // start of each channel in _in
+		jack_default_audio_sample_t **_out_channels;
+
+		pthread_t _thread;
+		std::atomic<int> _running;
+		uint32_t _xruns;
+
+		Audio_Process_Callback _callback;
+		void *_callback_arg;
+		Audio_Xrun_Callback _xrun_callback;
+		void *_xrun_callback_arg;
+};
+
+Alsa_Backend::Alsa_Backend(jack_nframes_t sample_rate, jack_nframes_t buffer_size, int channels)
+{
+	_capture = NULL;
+	_playback = NULL;
+	_format = SND_PCM_FORMAT_UNKNOWN;
+	_capture_channels = 0;
+	_playback_channels = 0;
+	_sample_rate = sample_rate;
+	_buffer_size = buffer_size;
+	_channels = channels;
+	_in = NULL;
+	_out = NULL;
+	_in_channels = new jack_default_audio_sample_t *[channels];
+	_out_channels = new jack_default_audio_sample_t *[channels];
+	_running = 0;
+	_xruns = 0;
+	_callback = NULL;
+	_callback_arg = NULL;
+	_xrun_callback = NULL;
+	_xrun_callback_arg = NULL;
+}
+
+Alsa_Backend::~Alsa_Backend()
+{
+	stop();
+	delete[] _in;
+	delete[] _out;
+	delete[] _in_channels;
+	delete[] _out_channels;
+}
+
+int Alsa_Backend::configure(snd_pcm_t *pcm, unsigned int *channels)
+{
+	const snd_pcm_format_t formats[] = { SND_PCM_FORMAT_FLOAT_LE, SND_PCM_FORMAT_S32_LE, SND_PCM_FORMAT_S16_LE };
+	snd_pcm_hw_params_t *hw;
+	snd_pcm_sw_params_t *sw;
+	unsigned int rate = _sample_rate;
+	unsigned int periods = ALSA_PERIODS;
+	snd_pcm_uframes_t period = _buffer_size;
+	int err;
+
+	snd_pcm_hw_params_malloc(&hw);
+	snd_pcm_hw_params_any(pcm, hw);
+
+	if ((err = snd_pcm_hw_params_set_access(pcm, hw, SND_PCM_ACCESS_MMAP_INTERLEAVED)) < 0) {
+		printf("ALSA device does not support mmap access: %s\n", snd_strerror(err));
+		snd_pcm_hw_params_free(hw);
+		return err;
+	}
+
+	// both streams have to agree on the format, so the capture stream picks it
+	if (_format == SND_PCM_FORMAT_UNKNOWN) {
+		for (unsigned int i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+			if (snd_pcm_hw_params_set_format(pcm, hw, formats[i]) == 0) {
+				_format = formats[i];
+				break;
+			}
+		}
+		err = _format == SND_PCM_FORMAT_UNKNOWN ? -EINVAL : 0;
+	} else {
+		err = snd_pcm_hw_params_set_format(pcm, hw, _format);
+	}
+	if (err < 0) {
+		printf("ALSA device does not support a usable sample format in both directions\n");
+		snd_pcm_hw_params_free(hw);
+		return err;
+	}
+
+	*channels = _channels;
+	snd_pcm_hw_params_set_channels_near(pcm, hw, channels);
+	snd_pcm_hw_params_set_rate_near(pcm, hw, &rate, NULL);
+	snd_pcm_hw_params_set_period_size_near(pcm, hw, &period, NULL);
+	snd_pcm_hw_params_set_periods_near(pcm, hw, &periods, NULL);
+
+	err = snd_pcm_hw_params(pcm, hw);
+	snd_pcm_hw_params_free(hw);
+	if (err < 0) {
+		printf("Could not configure ALSA device: %s\n", snd_strerror(err));
+		return err;
+	}
+
+	_sample_rate = rate;
+	_buffer_size = period;
+
+	// wake up once per period and leave starting the streams to us
+	snd_pcm_sw_params_malloc(&sw);
+	snd_pcm_sw_params_current(pcm, sw);
+	snd_pcm_sw_params_set_avail_min(pcm, sw, period);
+	snd_pcm_sw_params_set_start_threshold(pcm, sw, (snd_pcm_uframes_t)-1);
+	err = snd_pcm_sw_params(pcm, sw);
+	snd_pcm_sw_params_free(sw);
+
+	return err;
+}
+
+int Alsa_Backend::open(const char *name)
+{
+	const char *device = name != NULL ? name : "hw:0";
+	int err;
+
+	if ((err = snd_pcm_open(&_capture, device, SND_PCM_STREAM_CAPTURE, 0)) < 0 ||
+		(err = snd_pcm_open(&_playback, device, SND_PCM_STREAM_PLAYBACK, 0)) < 0) {
+		printf("Could not open ALSA device %s: %s\n", device, snd_strerror(err));
+		return -1;
+	}
+
+	if (configure(_capture, &_capture_channels) < 0) {
+		return -1;
+	}
+
+	// the linked streams only stay in step if playback runs at exactly capture's rate and period
+	const jack_nframes_t capture_rate = _sample_rate;
+	const jack_nframes_t capture_period = _buffer_size;
+	if (configure(_playback, &_playback_channels) < 0) {
+		return -1;
+	}
+	if (_sample_rate != capture_rate || _buffer_size != capture_period) {
+		printf("ALSA device %s runs capture at %u Hz with %u sample periods but playback at %u Hz with %u\n",
+			device, capture_rate, capture_period, _sample_rate, _buffer_size);
+		return -1;
+	}
+
+	if (snd_pcm_link(_capture, _playback) < 0) {
+		printf("Could not link ALSA capture and playback streams\n");
+		return -1;
+	}
+
+	_in = new jack_default_audio_sample_t[_channels * _buffer_size]();
+	_out = new jack_default_audio_sample_t[_channels * _buffer_size]();
+	for (int c = 0; c < _channels; c++) {
+		_in_channels[c] = _in + c * _buffer_size;
+		_out_channels[c] = _out + c * _buffer_size;
+	}
+
+	printf("ALSA %s: %s, %u Hz, %u sample periods, %u in / %u out channels\n", device,
+		snd_pcm_format_name(_format), _sample_rate, _buffer_size, _capture_channels, _playback_channels);
+	return 0;
+}
+
+int Alsa_Backend::recover(int err)
+{
+	_xruns++;
+
+	snd_pcm_drop(_capture);
+	if ((err = snd_pcm_prepare(_capture)) < 0) return err;
+
+	// prime playback with silence so output stays a fixed number of periods behind input
+	memset(_out, 0, sizeof(jack_default_audio_sample_t) * _channels * _buffer_size);
+	for (int i = 0; i < ALSA_PERIODS; i++) {
+		if ((err = writePeriod()) < 0) return err;
+	}
+
+	return snd_pcm_start(_capture);
+}
+
+float Alsa_Backend::decodeSample(const uint8_t *frame, unsigned int channel)
+{
+	if (_format == SND_PCM_FORMAT_FLOAT_LE) {
+		return ((const float *) frame)[channel];
+	} else if (_format == SND_PCM_FORMAT_S32_LE) {
+		return ((const int32_t *) frame)[channel] / 2147483648.0f;
+	} else {
+		return ((const int16_t *) frame)[channel] / 32768.0f;
+	}
+}
+
+void Alsa_Backend::encodeSample(uint8_t *frame, unsigned int channel, float sample)
+{
+	if (sample > 1.0f) sample = 1.0f;
+	else if (sample < -1.0f) sample = -1.0f;
+
+	if (_format == SND_PCM_FORMAT_FLOAT_LE) {
+		((float *) frame)[channel] = sample;
+	} else if (_format == SND_PCM_FORMAT_S32_LE) {
+		((int32_t *) frame)[channel] = (int32_t)(sample * 2147483647.0);
+	} else {
+		((int16_t *) frame)[channel] = (int16_t)(sample * 32767.0f);
+	}
+}
+
+int Alsa_Backend::readPeriod(void)
+{
+	jack_nframes_t done = 0;
+
+	while (done < _buffer_size) {
+		const snd_pcm_channel_area_t *areas;
+		snd_pcm_uframes_t offset, frames = _buffer_size - done;
+
+		int err = snd_pcm_mmap_begin(_capture, &areas, &offset, &frames);
+		if (err < 0) return err;
+
+		// interleaved, so every channel shares one area with a step of one whole frame
+		const uint8_t *base = (const uint8_t *) areas[0].addr + areas[0].first / 8 + offset * (areas[0].step / 8);
+		const unsigned int stride = areas[0].step / 8;
+
+		for (snd_pcm_uframes_t i = 0; i < frames; i++) {
+			const uint8_t *frame = base + i * stride;
+			for (int c = 0; c < _channels; c++) {
+				const unsigned int source = (unsigned int) c < _capture_channels ? c : _capture_channels - 1;
+				_in_channels[c][done + i] = decodeSample(frame, source);
+			}
+		}
+
+		snd_pcm_sframes_t committed = snd_pcm_mmap_commit(_capture, offset, frames);
+		if (committed < 0) return committed;
+		done += committed;
+	}
+
+	return 0;
+}
+
+int Alsa_Backend::writePeriod(void)
+{
+	jack_nframes_t done = 0;
+
+	while (done < _buffer_size) {
+		const snd_pcm_channel_area_t *areas;
+		snd_pcm_uframes_t offset, frames = _buffer_size - done;
+
+		int err = snd_pcm_mmap_begin(_playback, &areas, &offset, &frames);
+		if (err < 0) return err;
+
+		uint8_t *base = (uint8_t *) areas[0].addr + areas[0].first / 8 + offset * (areas[0].step / 8);
+		const unsigned int stride = areas[0].step / 8;
+
+		for (snd_pcm_uframes_t i = 0; i < frames; i++) {
+			uint8_t *frame = base + i * stride;
+			for (unsigned int c = 0; c < _playback_channels; c++) {
+				const int source = c < (unsigned int) _channels ? c : _channels - 1;
+				encodeSample(frame, c, _out_channels[source][done + i]);
+			}
+		}
+
+		snd_pcm_sframes_t committed = snd_pcm_mmap_commit(_playback, offset, frames);
+		if (committed < 0) return committed;
+		done += committed;
+	}
+
+	return 0;
+}
+
+void *Alsa_Backend::audioThread(void *arg)
+{
+	Alsa_Backend *backend = static_cast<Alsa_Backend *>(arg);
+
+	struct sched_param param;
+	param.sched_priority = ALSA_THREAD_PRIORITY;
+	if (pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+		printf("Warning: could not get SCHED_FIFO priority for the ALSA thread\n");
+	}
+
+	int err = backend->recover(0);
+	backend->_xruns = 0;
+
+	while (backend->_running) {
+		if (err < 0) {
+			if (backend->_xrun_callback != NULL) backend->_xrun_callback(backend->_xrun_callback_arg);
+			if ((err = backend->recover(err)) < 0) {
+				printf("ALSA recovery failed: %s\n", snd_strerror(err));
+				break;
+			}
+		}
+
+		if ((err = snd_pcm_wait(backend->_capture, 1000)) < 0) continue;
+
+		snd_pcm_sframes_t avail = snd_pcm_avail_update(backend->_capture);
+		if (avail < 0) {
+			err = avail;
+			continue;
+		}
+		if ((jack_nframes_t) avail < backend->_buffer_size) continue;
+
+		if ((err = backend->readPeriod()) < 0) continue;
+
+		backend->_callback(backend->_in_channels, backend->_out_channels, backend->_buffer_size, backend->_callback_arg);
+
+		err = backend->writePeriod();
+	}
+
+	return NULL;
+}
+
+int Alsa_Backend::start(Audio_Process_Callback callback, void *arg)
+{
+	_callback = callback;
+	_callback_arg = arg;
+	_running = 1;
+
+	if (pthread_create(&_thread, NULL, audioThread, this) != 0) {
+		printf("Could not start ALSA thread\n");
+		_running = 0;
+		return -1;
+	}
+
+	return 0;
+}
+
+void Alsa_Backend::onXrun(Audio_Xrun_Callback callback, void *arg)
+{
+	_xrun_callback = callback;
+	_xrun_callback_arg = arg;
+}
+
+void Alsa_Backend::stop(void)
+{
+	if (_running) {
+		_running = 0;
+		pthread_join(_thread, NULL);
+		printf("ALSA backend stopped after %u xruns\n", _xruns);
+	}
+
+	if (_capture != NULL) {
+		snd_pcm_drop(_capture);
+		snd_pcm_close(_capture);
+		_capture = NULL;
+	}
+	if (_playback != NULL) {
+		snd_pcm_close(_playback);
+		_playback = NULL;
+	}
+}
+
+jack_nframes_t Alsa_Backend::sampleRate(void)
+{
+	return _sample_rate;
+}
+
+jack_nframes_t Alsa_Backend::bufferSize(void)
+{
+	return _buffer_size;
+}
+
+#endif
+
+/** @} */
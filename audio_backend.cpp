@@ -0,0 +1,135 @@
+/** @file
+ * @addtogroup backend Audio Backends
+ *
+ * @{
+ *
+ * @brief This file contains the interface that sits between the pedal's process callback
+ * and whatever is moving audio in and out of the machine. Details follow.
+ *
+ * A backend owns the audio thread. Once started it calls the process callback with one
+ * period of input samples and a buffer to write one period of output samples into, and
+ * it keeps doing so until it is stopped. Each is a separate (non-interleaved) buffer per
+ * channel, with as many channels as the backend was created with. Three backends are available:
+ *
+ * - `Jack_Backend` runs as a JACK client wired to the physical ports (the original path).
+ * - `Alsa_Backend` drives an ALSA device directly through mmap, with no JACK server.
+ * - `Null_Backend` needs no audio hardware at all and is used for soak tests and
+ *   benchmarks.
+ */
+#pragma once
+
+#ifndef AUDIO_BACKEND_CPP_
+#define AUDIO_BACKEND_CPP_
+
+#include <jack/jack.h>
+
+/** Called by the backend once per period from its audio thread.
+ *
+ * `in[c]` and `out[c]` may point to the same buffer.
+ *
+ * @param in One period of input samples for each channel
+ * @param out Where to write one period of output samples for each channel
+ * @param nframes The number of samples in the period
+ * @param arg The pointer that was passed to `Audio_Backend::start`
+ *
+ * @return 0 to keep running
+ */
+typedef int (*Audio_Process_Callback)(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, jack_nframes_t nframes, void *arg);
+
+/** Called by the backend when the sampling rate changes while it is running.
+ *
+ * This is not called on the audio thread, so it must not touch the DSP objects directly.
+ *
+ * @param rate The new sampling rate in Hz
+ * @param arg The pointer that was passed to `Audio_Backend::onSampleRate`
+ */
+typedef void (*Audio_Rate_Callback)(jack_nframes_t rate, void *arg);
+
+/** Called by the backend before the number of samples in each period changes.
+ *
+ * This is not called on the audio thread, so it may allocate. The process callback will
+ * see the new period size some time after this returns.
+ *
+ * @param nframes The new number of samples per period
+ * @param arg The pointer that was passed to `Audio_Backend::onBufferSize`
+ */
+typedef void (*Audio_Buffer_Size_Callback)(jack_nframes_t nframes, void *arg);
+
+/** Called by the backend each time it misses a period (an xrun).
+ *
+ * This may be called on the audio thread, so it must not block or allocate.
+ *
+ * @param arg The pointer that was passed to `Audio_Backend::onXrun`
+ */
+typedef void (*Audio_Xrun_Callback)(void *arg);
+
+class Audio_Backend
+{
+	public:
+		/** Connect to the audio device or server.
+		 *
+		 * After this returns successfully `sampleRate` and `bufferSize` are valid, so the
+		 * DSP objects can be sized before any audio flows.
+		 *
+		 * @param name Client or device name; NULL picks the backend's default
+		 *
+		 * @return 0 on success
+		 */
+		virtual int open(const char *name) = 0;
+
+		/** Start calling `callback` once per period on the backend's audio thread.
+		 *
+		 * @return 0 on success
+		 */
+		virtual int start(Audio_Process_Callback callback, void *arg) = 0;
+
+		/** Stop the audio thread and release the device. */
+		virtual void stop(void) = 0;
+
+		/** Sampling rate in Hz that the backend is running at. */
+		virtual jack_nframes_t sampleRate(void) = 0;
+
+		/** Number of samples passed to each call of the process callback. */
+		virtual jack_nframes_t bufferSize(void) = 0;
+
+		/** Number of channels passed to each call of the process callback. */
+		virtual int channels(void) = 0;
+
+		/** SCHED_FIFO priority the audio thread runs at, or 0 if it is not real-time.
+		 * Valid once `open` has returned, so threads the audio thread waits on can be
+		 * given the same priority.
+		 */
+		virtual int realtimePriority(void) { return 0; }
+
+		/** Register a callback for sampling rate changes. Must be called before `start`.
+		 *
+		 * Backends whose rate is fixed once opened never call it.
+		 */
+		virtual void onSampleRate(Audio_Rate_Callback callback, void *arg) {}
+
+		/** Register a callback for period size changes. Must be called before `start`.
+		 *
+		 * Backends whose period size is fixed once opened never call it.
+		 */
+		virtual void onBufferSize(Audio_Buffer_Size_Callback callback, void *arg) {}
+
+		/** Register a callback for xruns. Must be called before `start`.
+		 *
+		 * Backends that cannot miss a period never call it.
+		 */
+		virtual void onXrun(Audio_Xrun_Callback callback, void *arg) {}
+
+		/** Report latency the processing adds on top of the hardware's, in samples. Must
+		 * be called before `start`, and can be called again from the buffer size callback
+		 * when the latency follows the period size.
+		 *
+		 * Backends with nobody downstream to tell ignore it.
+		 */
+		virtual void setLatency(jack_nframes_t samples) {}
+
+		virtual ~Audio_Backend() {}
+};
+
+#endif
+
+/** @} */
@@ -0,0 +1,225 @@
+/** @file
+ * @addtogroup bench DSP Benchmarks
+ *
+ * @{
+ *
+ * @brief This file contains a standalone benchmark for the DSP code. It needs no sound card
+ * or JACK server. Details follow.
+ *
+ * Each benchmark pushes a few seconds of a test signal through two implementations of the
+ * same processing at several block sizes. It reports the cost per sample of each, the
+ * speedup, and the largest difference between their outputs, so a faster version that
+ * sounds different shows up straight away.
+ *
+ * Build with the same flags as the pedal, e.g.
+ * `g++ -O2 -std=c++14 bench.cpp -o bench -lpthread`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <cmath>
+#include <time.h>
+#include <vector>
+#include <jack/jack.h>
+
+#include "fx_chain.cpp"
+#include "static_chain.cpp"
+#include "fx_graph.cpp"
+
+#define BENCH_SECONDS 20 ///< Seconds of audio pushed through each implementation
+
+static double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/** Fills a buffer with a guitar-like test signal: a decaying chord, repeated. */
+static void testSignal(std::vector<jack_default_audio_sample_t> &signal)
+{
+	for (size_t i = 0; i < signal.size(); i++) {
+		double t = (double)(i % DEFAULT_SAMPLE_RATE) / DEFAULT_SAMPLE_RATE;
+		signal[i] = 0.3 * exp(-3 * t) * (sin(2 * M_PI * 110 * t) + 0.5 * sin(2 * M_PI * 165 * t) + 0.25 * sin(2 * M_PI * 220 * t));
+	}
+}
+
+/** Runs `signal` through `fx` in blocks of `frames` samples and returns ns per sample. */
+template <typename FX>
+static double timeBlocks(FX &fx, const std::vector<jack_default_audio_sample_t> &signal, std::vector<jack_default_audio_sample_t> &output, jack_nframes_t frames)
+{
+	double start = now();
+	for (size_t pos = 0; pos + frames <= signal.size(); pos += frames) {
+		fx.process(&signal[pos], &output[pos], frames);
+	}
+	return (now() - start) * 1e9 / signal.size();
+}
+
+static float maxDifference(const std::vector<jack_default_audio_sample_t> &a, const std::vector<jack_default_audio_sample_t> &b)
+{
+	float diff = 0;
+	for (size_t i = 0; i < a.size(); i++) {
+		diff = fmaxf(diff, fabsf(a[i] - b[i]));
+	}
+	return diff;
+}
+
+/** Runtime FX_Chain against the compile-time Chain with overdrive, wah and tremolo. */
+static void benchChains(const std::vector<jack_default_audio_sample_t> &signal)
+{
+	const jack_nframes_t block_sizes[] = { 64, 128, 256 };
+	std::vector<jack_default_audio_sample_t> runtime_out(signal.size()), static_out(signal.size());
+
+	printf("Overdrive -> Wah -> Tremolo\n");
+	printf("%8s %14s %14s %9s %12s\n", "frames", "FX_Chain ns", "Chain<> ns", "speedup", "max diff");
+
+	for (size_t b = 0; b < sizeof(block_sizes) / sizeof(block_sizes[0]); b++) {
+		FX_Chain *runtime = new FX_Chain();
+		runtime->setSlotFx(0, OVERDRIVE);
+		runtime->setSlotFx(1, WAH);
+		runtime->setSlotFx(2, TREMOLO);
+
+		Chain<Overdrive, Wah, Tremolo> fused;
+
+		double runtime_ns = timeBlocks(*runtime, signal, runtime_out, block_sizes[b]);
+		double static_ns = timeBlocks(fused, signal, static_out, block_sizes[b]);
+
+		printf("%8u %14.2f %14.2f %8.2fx %12g\n", block_sizes[b], runtime_ns, static_ns,
+			runtime_ns / static_ns, maxDifference(runtime_out, static_out));
+
+		delete runtime;
+	}
+}
+
+/** Adapts a kernel function to the `process` interface used by `timeBlocks`. */
+struct Shaper
+{
+	Overdrive_Kernel overdrive;
+	Distortion_Kernel distortion;
+
+	void process(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes)
+	{
+		if (overdrive != NULL) overdrive(in, out, nframes, 2.0f);
+		else distortion(in, out, nframes, 4.0f, DISTORTION_LIMIT);
+	}
+};
+
+/** Scalar waveshaper kernels against the ones picked for this CPU. */
+static void benchShapers(const std::vector<jack_default_audio_sample_t> &signal)
+{
+	const Simd_Kernels &best = simdKernels();
+	std::vector<jack_default_audio_sample_t> scalar_out(signal.size()), simd_out(signal.size());
+
+	printf("\nWaveshapers at 128 frames, scalar against %s\n", best.name);
+	printf("%12s %14s %14s %9s %12s\n", "FX", "scalar ns", "simd ns", "speedup", "max diff");
+
+	for (int i = 0; i < 2; i++) {
+		Shaper scalar = { i == 0 ? scalar_kernels.overdrive : NULL, scalar_kernels.distortion };
+		Shaper simd = { i == 0 ? best.overdrive : NULL, best.distortion };
+
+		double scalar_ns = timeBlocks(scalar, signal, scalar_out, 128);
+		double simd_ns = timeBlocks(simd, signal, simd_out, 128);
+
+		printf("%12s %14.2f %14.2f %8.2fx %12g\n", i == 0 ? "overdrive" : "distortion",
+			scalar_ns, simd_ns, scalar_ns / simd_ns, maxDifference(scalar_out, simd_out));
+	}
+}
+
+/** Adapts a plain echo (no FX chain) to the `process` interface used by `timeBlocks`. */
+struct Echo
+{
+	Delay_Buffer delay;
+
+	Echo(double seconds) : delay(.6, .8, seconds, 128, DEFAULT_SAMPLE_RATE, 1)
+	{
+		delay._fx_chain = NULL;
+	}
+
+	void process(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes)
+	{
+		delay.newFrame(&in, &out, nframes);
+	}
+};
+
+/** An echo a whole number of samples long against one that falls between samples, which
+ * the delay has to interpolate.
+ */
+static void benchDelay(const std::vector<jack_default_audio_sample_t> &signal)
+{
+	std::vector<jack_default_audio_sample_t> whole_out(signal.size()), fractional_out(signal.size());
+
+	printf("\nEcho at 128 frames, whole-sample delay against a fractional one\n");
+	printf("%12s %14s %14s %9s\n", "delay", "whole ns", "fraction ns", "overhead");
+
+	Echo whole(.3);
+	Echo fractional(.3 + .5 / DEFAULT_SAMPLE_RATE);
+	double whole_ns = timeBlocks(whole, signal, whole_out, 128);
+	double fractional_ns = timeBlocks(fractional, signal, fractional_out, 128);
+
+	printf("%12s %14.2f %14.2f %8.1f%%\n", "300 ms", whole_ns, fractional_ns, (fractional_ns / whole_ns - 1) * 100);
+}
+
+/** Builds two parallel branches mixed with the dry signal: overdrive into wah, and reverb
+ * into tremolo into a delay.
+ */
+static void buildGraph(FX_Graph &graph)
+{
+	const int overdrive = graph.addFx(OVERDRIVE);
+	const int wah = graph.addFx(WAH);
+	const int reverb = graph.addFx(REVERB);
+	const int tremolo = graph.addFx(TREMOLO);
+	const int delay = graph.addDelay(.5, .8, .3);
+
+	graph.connect(FX_GRAPH_INPUT, overdrive);
+	graph.connect(overdrive, wah);
+	graph.connect(FX_GRAPH_INPUT, reverb);
+	graph.connect(reverb, tremolo);
+	graph.connect(tremolo, delay);
+	graph.connect(wah, FX_GRAPH_OUTPUT, .4);
+	graph.connect(delay, FX_GRAPH_OUTPUT, .4);
+	graph.connect(FX_GRAPH_INPUT, FX_GRAPH_OUTPUT, .2);
+}
+
+/** The FX graph run in sorted order on one thread against work stealing on a pool. */
+static void benchGraph(const std::vector<jack_default_audio_sample_t> &signal, int workers)
+{
+	const jack_nframes_t frames = 128;
+	std::vector<jack_default_audio_sample_t> serial_out(signal.size()), parallel_out(signal.size());
+
+	Worker_Pool pool;
+	if (pool.start(workers, 1, 0) != 0) return;
+
+	printf("\nFX graph at %u frames, one thread against %d workers\n", frames, workers);
+	printf("%12s %14s %14s %9s %12s\n", "graph", "serial ns", "parallel ns", "speedup", "max diff");
+
+	FX_Graph serial, parallel;
+	buildGraph(serial);
+	buildGraph(parallel);
+	serial.build(1, frames, DEFAULT_SAMPLE_RATE);
+	parallel.build(1, frames, DEFAULT_SAMPLE_RATE);
+	parallel.setWorkers(&pool);
+
+	double serial_ns = timeBlocks(serial, signal, serial_out, frames);
+	double parallel_ns = timeBlocks(parallel, signal, parallel_out, frames);
+
+	printf("%12s %14.2f %14.2f %8.2fx %12g\n", "two branch", serial_ns, parallel_ns,
+		serial_ns / parallel_ns, maxDifference(serial_out, parallel_out));
+
+	pool.stop();
+}
+
+int main(int argc, char *argv[])
+{
+	std::vector<jack_default_audio_sample_t> signal(BENCH_SECONDS * DEFAULT_SAMPLE_RATE);
+	testSignal(signal);
+
+	benchChains(signal);
+	benchShapers(signal);
+	benchDelay(signal);
+
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	benchGraph(signal, cpus > 1 ? cpus - 1 : 1);
+
+	return 0;
+}
+
+/** @} */
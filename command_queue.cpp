@@ -0,0 +1,112 @@
+/** @file
+ * @addtogroup commands Command Queue
+ *
+ * @{
+ *
+ * @brief This file contains the queue that carries control changes from the UART thread
+ * to the audio thread. Details follow.
+ *
+ * The delay buffer and FX processor are only ever touched by the audio thread once audio
+ * is running. Any other thread that wants to change them pushes a `Command` onto a
+ * `Command_Queue`, and the process callback drains the queue at the top of each period,
+ * so every change lands on a frame boundary and never in the middle of `process`.
+ *
+ * The queue is a fixed-size ring with exactly one producer and one consumer. Each side
+ * only writes its own index and reads the other's, so both `push` and `pop` finish in a
+ * bounded number of steps without locks, system calls or allocation.
+ */
+#pragma once
+
+#ifndef COMMAND_QUEUE_CPP_
+#define COMMAND_QUEUE_CPP_
+
+#include <stdint.h>
+#include <atomic>
+
+#define COMMAND_QUEUE_CAPACITY 64 ///< Number of commands the queue can hold (must be a power of two)
+
+enum Command_types {
+	CMD_NEXT_FX,			// switch the selected slot to the next FX
+	CMD_SET_FX,				// slot, arg = FX_types
+	CMD_SET_PARAM,			// slot (-1 for all), arg = FX_param_types, value = parameter value
+	CMD_SET_BYPASS,			// slot, arg = 1 to bypass, 0 to enable
+	CMD_MOVE_SLOT,			// slot = position to move from, arg = position to move to
+	CMD_SELECT_SLOT,		// slot
+	CMD_SET_DELAY_LENGTH,	// value = seconds
+	CMD_SET_DELAY_CHANGE,	// arg = Delay_Change_types
+	CMD_SET_TAPS,			// arg = number of taps, 0 for a single echo
+	CMD_SET_TAP,			// slot = tap, arg = Delay_Subdivision_types, value = level
+	CMD_SET_TAP_PAN,		// slot = tap, value = pan
+	CMD_SET_FEEDBACK_LOWPASS,	// value = cutoff in Hz, 0 for none
+	CMD_SET_FEEDBACK_HIGHPASS,	// value = cutoff in Hz, 0 for none
+	CMD_SET_FEEDBACK_DRIVE,	// value = drive
+	CMD_SET_WOW_FLUTTER,	// value = depth
+	CMD_SET_DECAY,			// value = decay
+	CMD_SET_LEVEL			// value = level
+}; ///< Changes that can be sent to the audio thread
+
+/** A single control change for the audio thread. */
+struct Command
+{
+	Command_types type;
+	int strip; // which strip of the rack to change
+	int slot;
+	int arg;
+	double value;
+};
+
+class Command_Queue
+{
+	public:
+		/** Add a command to the queue. Must only be called from the producer thread.
+		 *
+		 * @return 1 if the command was queued, 0 if the queue was full
+		 */
+		int push(const Command &command);
+
+		/** Take the oldest command off the queue. Must only be called from the consumer
+		 * thread.
+		 *
+		 * @return 1 if a command was written to `command`, 0 if the queue was empty
+		 */
+		int pop(Command &command);
+
+		Command_Queue();
+
+	private:
+		Command _commands[COMMAND_QUEUE_CAPACITY];
+
+		// each index lives on its own cache line so the two threads don't share one
+		alignas(64) std::atomic<uint32_t> _head; // next slot to read, written by the consumer
+		alignas(64) std::atomic<uint32_t> _tail; // next slot to write, written by the producer
+};
+
+Command_Queue::Command_Queue()
+{
+	_head.store(0, std::memory_order_relaxed);
+	_tail.store(0, std::memory_order_relaxed);
+}
+
+int Command_Queue::push(const Command &command)
+{
+	uint32_t tail = _tail.load(std::memory_order_relaxed);
+	if (tail - _head.load(std::memory_order_acquire) == COMMAND_QUEUE_CAPACITY) return 0;
+
+	_commands[tail & (COMMAND_QUEUE_CAPACITY - 1)] = command;
+	_tail.store(tail + 1, std::memory_order_release);
+	return 1;
+}
+
+int Command_Queue::pop(Command &command)
+{
+	uint32_t head = _head.load(std::memory_order_relaxed);
+	if (head == _tail.load(std::memory_order_acquire)) return 0;
+
+	command = _commands[head & (COMMAND_QUEUE_CAPACITY - 1)];
+	_head.store(head + 1, std::memory_order_release);
+	return 1;
+}
+
+#endif
+
+/** @} */
@@ -7,6 +7,53 @@
  *
  * @brief This file contains the class interface and implementation for the delay buffer object.
  * Details follow.
+ *
+ * Each channel's echoes live in a ring whose size is a power of two, so a position wraps
+ * with a mask instead of a comparison. The ring is sized for the longest delay the preset
+ * needs at the rate the audio actually runs at, so a 300 ms slapback takes a small
+ * fraction of what a 10 s ambient delay does. Dry samples go in at the write head and echoes come
+ * out at the read head, which trails it by the delay length, whatever the period size.
+ * The delay does not have to be a whole number of samples: the read head interpolates
+ * between the four samples around it with a cubic (Catmull-Rom) curve. A few guard samples
+ * past each end of the ring mirror the other end, so the four samples are always next to
+ * each other in memory. Each period walks the ring in contiguous spans, split only where a
+ * head wraps, so the inner loops have no wrap check. While the delay is steady the
+ * interpolation weights are the same for every sample and the read vectorizes; a whole
+ * number of samples needs no interpolation at all.
+ *
+ * A new delay time (from tap tempo, say) is reached in one of two ways:
+ *
+ * - `DELAY_CROSSFADE` starts a second read head at the new delay and fades over to it in
+ *   DELAY_CROSSFADE_SECONDS, so the echoes jump to the new time without a click. A change
+ *   that arrives during a fade waits for it to finish.
+ * - `DELAY_GLIDE` slides the read head over to the new delay like the tape in a tape
+ *   echo, so the echoes bend in pitch on the way. The head never moves faster than
+ *   DELAY_GLIDE_MAX_RATE samples per sample, which bounds the bend.
+ *
+ * In multi-tap mode, up to DELAY_MAX_TAPS taps are heard instead of the single echo. Each
+ * tap sits at a subdivision of the delay (the tapped quarter note), such as a dotted
+ * eighth or a triplet, with its own level and pan, so the taps follow tap tempo, glides and
+ * crossfades along with it. Every tap reads the same ring and is added straight into the
+ * wet signal, so a tap costs one read of the block and no memory of its own. Only the
+ * quarter note is fed back, so the taps shape what is heard but not how the echoes repeat.
+ *
+ * The feedback path can be voiced like an analog or tape delay, so each repeat comes back
+ * darker, thinner or more worn than the last: a one-pole lowpass, a one-pole highpass and
+ * soft saturation all run inside the pass that writes the ring, so they cost no extra trip
+ * through it. Their state is one value per channel, kept in registers for the span. The
+ * filters' recursion runs sample by sample, and the saturation and the write vectorize
+ * after it. Wow and flutter sway the read head with two slow sine waves, worked out once
+ * per block and swept across it like a glide. With all of it off, the feedback is the
+ * plain multiply by the decay.
+ *
+ * A new sampling rate or longest delay can need a different ring. The ring is allocated
+ * off the audio thread and handed over with `setRing`, which only swaps a pointer and
+ * starts the echoes over from silence; until then the delay is held to what the old ring
+ * can hold.
+ *
+ * A delay buffer owns its echo and wet buffers (see @ref harden "RT Hardening" for where they
+ * come from). It can be moved, which hands the buffers over without copying a sample, but
+ * not copied, so a buffer can never end up with two owners or none.
  */
 #pragma once
 
@@ -20,35 +67,128 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <cstring>
+#include <utility>
 
-#include "fx_processor.cpp"
+#include "fx_chain.cpp"
+#include "fx_pipeline.cpp"
+#include "fx_simd.cpp"
+#include "rt_log.cpp"
 
-// 2 seconds * 44100 Hz
-#define BUFFER_CAPACITY 88200
-#define SAMPLE_RATE 	44100
+#define DELAY_DEFAULT_MAX_SECONDS 2 ///< Longest delay a ring is sized for unless asked for more
+#define DELAY_MAX_SECONDS 60 ///< Longest delay a ring can be sized for
+#define DELAY_RING_GUARD 3 ///< Mirrored samples around each ring: one before the start, two after the end
+#define DELAY_MIN_SAMPLES 4 ///< Shortest delay, so the interpolator never reads a sample not yet written
+#define DELAY_CROSSFADE_SECONDS 0.03 ///< Length of the fade between two read heads
+#define DELAY_READ_CHUNK 256 ///< Most samples read at once into a buffer on the stack, during a fade or for taps
+#define DELAY_GLIDE_SECONDS 0.1 ///< Time constant of the tape-style glide
+#define DELAY_GLIDE_MAX_RATE 0.5 ///< Fastest the delay changes while gliding, in samples per sample
+#define DELAY_MAX_TAPS 8 ///< Most taps heard in multi-tap mode
+#define DELAY_DRIVE_MAX 4 ///< Saturation curve at full feedback drive; higher clips softer signals
+#define DELAY_WOW_HZ 0.7 ///< Rate of the slow wow
+#define DELAY_WOW_SECONDS 0.0015 ///< Peak-to-peak wow at full depth
+#define DELAY_FLUTTER_HZ 7 ///< Rate of the fast flutter
+#define DELAY_FLUTTER_SECONDS 0.0002 ///< Peak-to-peak flutter at full depth
+
+enum Delay_Change_types {
+	DELAY_CROSSFADE,	// fade from the old read head to a new one
+	DELAY_GLIDE			// slide the read head over, bending the pitch like tape
+}; ///< How the echo follows a new delay length
+
+enum Delay_Subdivision_types {
+	DELAY_QUARTER,			// the delay itself
+	DELAY_DOTTED_EIGHTH,	// 3/4 of the delay
+	DELAY_EIGHTH,			// 1/2 of the delay
+	DELAY_TRIPLET			// 2/3 of the delay, a quarter note triplet
+}; ///< Where a tap sits, as a note value against the delay's quarter note
+
+/** Runs a block of echoes through FX in place, instead of the FX chain (see `setEchoFx`). */
+typedef void (*Delay_Echo_Fx)(void *arg, jack_default_audio_sample_t *const *echo, jack_nframes_t nframes);
+
+/** One tap of a multi-tap delay. */
+struct Delay_Tap
+{
+	int subdivision; ///< Delay_Subdivision_types
+	double level; ///< 0 to 1
+	double pan; ///< -1 for the first channel of each pair only, 1 for the second, 0 for both
+};
 
 class Delay_Buffer
 {
 	public:
-		/** Add a frame of samples to the buffer and set the output buffer to the mixture
-		 * of the delay and the dry signal.
+		/** Add a frame of samples to the buffer and write the mixture of the delay and the
+		 * dry signal to `out`.
 		 *
 		 * All samples will be added to the buffer, mixed with the existing samples, and
-		 * the `_output_buffer` will be set to the mixture of the dry signal and the effect.
+		 * `out` will be set to the mixture of the dry signal and the effect. The FX write
+		 * straight into `out`, so the output can be the sound card's own buffer.
+		 *
+		 * Each channel has its own echo, but they all share one position, length, decay
+		 * and level, so a tempo change moves every channel together. `in[c]` and `out[c]`
+		 * may point to the same buffer, as JACK sometimes arranges. A frame longer than the
+		 * frame size is processed in pieces.
 		 *
-		 * @param sample Pointer to the frame of samples to add to the buffer
+		 * @param in One pointer per channel to the frame of samples to add to the buffer
+		 * @param out One pointer per channel to where the mixed frame is written
+		 * @param nframes The number of samples in the frame
 		 */
-		void newFrame(jack_default_audio_sample_t *sample);
+		void newFrame(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, jack_nframes_t nframes);
 		
 		/** Set the duration of the delay in seconds.
 		 *
-		 * The size of the buffer will automatically be calculated and matched as closely
-		 * as possible to achieve the desired duration.
+		 * The delay can fall between samples, from DELAY_MIN_SAMPLES up to one sample
+		 * less than the ring, and does not depend on the frame size. A running delay
+		 * moves to the new length as set by `setDelayChange`.
 		 *
 		 * @param seconds Number of seconds before echo is heard
 		 */
 		void setDelayLength(double seconds);
 		
+		/** Choose how the echo follows a new delay length, from Delay_Change_types. */
+		void setDelayChange(int change) { _change = change; }
+		
+		/** Switch to multi-tap mode with the first `count` taps, or back to a single echo
+		 * with 0. Taps start as a full level, centred quarter note.
+		 */
+		void setTaps(int count);
+		
+		/** Set where a tap sits and how loud it is.
+		 *
+		 * @param tap Which tap, from 0 to DELAY_MAX_TAPS - 1
+		 * @param subdivision Delay_Subdivision_types
+		 * @param level Volume of the tap (0 <= level <= 1)
+		 */
+		void setTap(int tap, int subdivision, double level);
+		
+		/** Pan a tap between the two channels of each pair (-1 <= pan <= 1). A mono delay
+		 * ignores pan.
+		 */
+		void setTapPan(int tap, double pan);
+		
+		/** Darken each repeat with a lowpass filter in the feedback path.
+		 *
+		 * @param hz Cutoff frequency, or 0 for no lowpass
+		 */
+		void setFeedbackLowpass(double hz);
+		
+		/** Thin each repeat with a highpass filter in the feedback path.
+		 *
+		 * @param hz Cutoff frequency, or 0 for no highpass
+		 */
+		void setFeedbackHighpass(double hz);
+		
+		/** Soft-saturate each repeat in the feedback path. Quiet echoes pass unchanged and
+		 * loud ones are rounded off, so high feedback builds up warmth instead of clipping.
+		 *
+		 * @param drive Amount of saturation (0 <= drive <= 1), 0 for none
+		 */
+		void setFeedbackDrive(double drive);
+		
+		/** Sway the delay time like a worn tape transport.
+		 *
+		 * @param depth Amount of wow and flutter (0 <= depth <= 1), 0 for none
+		 */
+		void setWowFlutter(double depth);
+		
 		/** Set the rate of decay of the delay effect.
 		 *
 		 * This controls how long the echoing signal will be heard after it occurs. If the
@@ -68,29 +208,168 @@ class Delay_Buffer
 		 */
 		void setLevel(double level);
 		
+		/** Set the sampling rate the delay runs at.
+		 *
+		 * The delay length is kept in seconds, so the read head jumps straight to the
+		 * same time at the new rate. This never allocates: if the ring is too short for
+		 * the longest delay at the new rate, the delay is held to what it can hold until
+		 * `setRing` hands over a longer one.
+		 *
+		 * @param rate Sampling rate in Hz
+		 */
+		void setSampleRate(jack_nframes_t rate);
+		
+		/** Change the number of samples in each frame.
+		 *
+		 * The new wet buffer has to be allocated by the caller, off the audio thread, so
+		 * that the swap itself never allocates. A pipeline set with `setPipeline` moves to
+		 * the new period size as well.
+		 *
+		 * @param frame_size The number of samples in each frame from now on
+		 * @param wet_buffer A buffer of at least `frame_size` samples per channel for in-place frames
+		 *
+		 * @return The previous wet buffer, which the caller frees off the audio thread
+		 */
+		jack_default_audio_sample_t *setFrameSize(jack_nframes_t frame_size, jack_default_audio_sample_t *wet_buffer);
+		
+		/** Swap in a new echo ring, starting the echoes over from silence.
+		 *
+		 * The ring has to be allocated by the caller, off the audio thread, with
+		 * `ringSamples(ring_size, channels())` zeroed samples, so that the swap itself
+		 * never allocates.
+		 *
+		 * @param ring The new ring
+		 * @param ring_size Samples per channel, from `ringSizeFor`
+		 * @param max_seconds The longest delay the ring was sized for
+		 *
+		 * @return The previous ring, which the caller frees off the audio thread
+		 */
+		jack_default_audio_sample_t *setRing(jack_default_audio_sample_t *ring, uint32_t ring_size, double max_seconds);
+		
+		/** Samples per channel a ring needs to hold `max_seconds` of delay at `rate`: the
+		 * power of two above it, so a position wraps with a mask.
+		 */
+		static uint32_t ringSizeFor(double max_seconds, jack_nframes_t rate);
+		
+		/** Samples to allocate for a ring of `ring_size` with `channels` channels,
+		 * including the guard samples.
+		 */
+		static size_t ringSamples(uint32_t ring_size, int channels) { return (size_t) channels * (ring_size + DELAY_RING_GUARD); }
+		
+		/** Run the FX chain through a pipeline instead of calling it directly, or NULL to
+		 * stop.
+		 *
+		 * The pipeline must be set up for `_fx_chain` with this buffer's channel count as
+		 * both its channels and its carried channels. The dry signal is carried through it
+		 * alongside the echo, so the whole output is delayed by the pipeline's latency and
+		 * otherwise sounds exactly the same.
+		 */
+		void setPipeline(FX_Pipeline *pipeline) { _pipeline = pipeline; }
+		
+		/** Run the echo through `fx`, called with `arg`, instead of `_fx_chain`, or NULL to
+		 * go back to the chain. This is how an @ref graph "FX Graph" is hooked in, since
+		 * the graph's own nodes may be delay buffers.
+		 */
+		void setEchoFx(Delay_Echo_Fx fx, void *arg) { _echo_fx = fx; _echo_fx_arg = arg; }
+		
+		/** Number of samples between a dry sample going in and its first echo, which
+		 * lags the length asked for while the delay glides or fades.
+		 */
+		double delaySamples(void) const { return _delay; }
+		
+		/** Samples per channel in the echo ring. */
+		uint32_t ringSize(void) const { return _ring_size; }
+		
+		/** Longest delay the ring was sized for, in seconds. */
+		double maxSeconds(void) const { return _max_seconds; }
+		
+		/** Number of samples in each frame passed to `newFrame`. */
+		jack_nframes_t frameSize(void) const { return _frame_size; }
+		
+		/** Number of channels passed to `newFrame`. */
+		int channels(void) const { return _channels; }
+		
 		/** Initialize a delay buffer
 		 *
 		 * @param decay The rate of decay for the buffer (see `setDecay`)
 		 * @param level The level of the delay (see `setLevel`)
 		 * @param duration The duration of the delay (see `setDelayLength`)
 		 * @param frame_size The number of samples in each frame when `process` is called
+		 * @param sample_rate The sampling rate of the audio (see `setSampleRate`)
+		 * @param channels The number of channels, from 1 to FX_MAX_CHANNELS
+		 * @param max_seconds The longest delay to size the ring for; `duration` if that is longer
 		 */
-		Delay_Buffer(double, double, double, jack_nframes_t);
+		Delay_Buffer(double, double, double, jack_nframes_t, jack_nframes_t sample_rate = DEFAULT_SAMPLE_RATE, int channels = 1, double max_seconds = DELAY_DEFAULT_MAX_SECONDS);
+		
+		/** Initialize an empty placeholder with no channels, to be assigned over later. */
 		Delay_Buffer();
+		~Delay_Buffer();
 		
-		jack_default_audio_sample_t *_output_buffer; ///< Holds one frame of data to be output each time the `newFrame` function is called
+		Delay_Buffer(const Delay_Buffer &) = delete;
+		Delay_Buffer &operator=(const Delay_Buffer &) = delete;
 		
-		FX_Processor *_fx_processor; ///< Holds a pointer to the FX Processor object that will process each sample as it's echoed
+		/** Take over another delay's buffers and settings, leaving it an empty placeholder. */
+		Delay_Buffer(Delay_Buffer &&other);
+		Delay_Buffer &operator=(Delay_Buffer &&other);
+		
+		FX_Chain *_fx_chain; ///< Holds a pointer to the FX chain that will process each frame as it's echoed, or NULL for a plain echo
 		
 	private:
-		uint32_t _buffer_ind; // location of the current index of the delay buffer
-		jack_default_audio_sample_t _buffer[BUFFER_CAPACITY]; // delay buffer
+		void setDelayTarget(double seconds, int jump);
+		jack_nframes_t readLimit(void) const;
+		void readEchoes(const jack_default_audio_sample_t *ring, double from, double to, double fade_from, double fade_to, jack_default_audio_sample_t *echo, jack_nframes_t nframes);
+		void readTaps(const jack_default_audio_sample_t *ring, double from, double to, double fade_from, double fade_to, int channel, jack_default_audio_sample_t *wet, jack_nframes_t nframes);
+		void voiceEchoes(float &lowpass_state, float &highpass_state, jack_default_audio_sample_t *echo, jack_nframes_t nframes);
+		void writeRing(int channel, jack_default_audio_sample_t *ring, const jack_default_audio_sample_t *dry, jack_default_audio_sample_t *echo, jack_nframes_t nframes);
+		void updateVoicing(void);
+		void startFade(void);
+		void echoFrame(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *echo, jack_nframes_t nframes);
+		void newPipelinedFrame(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, jack_nframes_t nframes);
+		
+		FX_Pipeline *_pipeline; // runs _fx_chain over several periods when set
+		Delay_Echo_Fx _echo_fx; // runs instead of _fx_chain when set
+		void *_echo_fx_arg;
+		uint32_t _write_ind; // where the next dry sample goes; counts up forever and is masked on use
+		jack_default_audio_sample_t *_buffer; // echo rings, _ring_size plus guard samples per channel
+		uint32_t _ring_size; // samples per channel in each ring, a power of two
+		uint32_t _ring_mask; // _ring_size - 1
+		double _max_seconds; // longest delay the rings were sized for
+		int _channels; // number of channels in each frame
 		jack_nframes_t _frame_size; // number of samples per frame received
+		jack_default_audio_sample_t *_wet_buffer; // FX output when a frame is processed in place, _frame_size per channel
+		jack_nframes_t _sample_rate; // samples per second
 		
 		int _active;
 		
 		// user settings
-		uint32_t _max_buffer_ind; // ending point of buffer (i.e. duration)
+		double _delay; // distance from the write head back to the read head in samples (i.e. duration)
+		double _target; // delay in samples that _delay is heading for
+		double _fade_from; // delay of the read head being faded out
+		uint32_t _fade_left; // samples left in the current fade, 0 if there is none
+		uint32_t _fade_length; // samples in a whole fade
+		double _glide_pole; // fraction of the distance to _target left after each sample of a glide
+		int _change; // Delay_Change_types
+		Delay_Tap _taps[DELAY_MAX_TAPS];
+		int _tap_count; // 0 for a single echo
+		
+		// feedback voicing
+		double _lowpass_hz; // 0 for none
+		double _highpass_hz; // 0 for none
+		double _drive;
+		double _wow_depth;
+		float _lowpass_coefficient; // share of the way each sample moves towards its input
+		float _highpass_coefficient;
+		float _drive_curve; // 0 for no saturation
+		double _wow_samples; // peak-to-peak wow at the current rate
+		double _flutter_samples;
+		double _wow_phase; // radians
+		double _flutter_phase;
+		double _wow_offset; // delay added at the end of the last frame
+		float _lowpass_state[FX_MAX_CHANNELS];
+		float _highpass_state[FX_MAX_CHANNELS]; // the lowpassed signal the highpass takes away
+		float _tap_lowpass_state[FX_MAX_CHANNELS]; // the same for the tap mix, which is voiced apart from the feedback
+		float _tap_highpass_state[FX_MAX_CHANNELS];
+		double _delay_seconds; // duration as set by the user
 		double _decay; // decay factor multiplied at each pass
 		double _level; // level of effect
 	
@@ -99,36 +378,295 @@ class Delay_Buffer
 
 Delay_Buffer::Delay_Buffer()
 {
-	_active = 1;
+	_active = 0;
+	_fx_chain = NULL;
+	_pipeline = NULL;
+	_echo_fx = NULL;
+	_echo_fx_arg = NULL;
 	
-	_buffer_ind = 0;
-	_frame_size = 0;
-	_output_buffer = new jack_default_audio_sample_t[512];
+	_write_ind = 0;
+	_buffer = NULL;
+	_ring_size = 0;
+	_ring_mask = 0;
+	_max_seconds = DELAY_DEFAULT_MAX_SECONDS;
+	_channels = 0;
+	_frame_size = 512;
+	_sample_rate = DEFAULT_SAMPLE_RATE;
+	_wet_buffer = NULL;
 	
-	_max_buffer_ind = BUFFER_CAPACITY - 1;
+	_delay = DELAY_MIN_SAMPLES;
+	_target = _delay;
+	_fade_from = _delay;
+	_fade_left = 0;
+	_fade_length = 1;
+	_glide_pole = 0;
+	_change = DELAY_CROSSFADE;
+	_tap_count = 0;
+	_lowpass_hz = 0;
+	_highpass_hz = 0;
+	_drive = 0;
+	_wow_depth = 0;
+	_wow_phase = 0;
+	_flutter_phase = 0;
+	_wow_offset = 0;
+	for (int c = 0; c < FX_MAX_CHANNELS; c++) {
+		_lowpass_state[c] = 0;
+		_highpass_state[c] = 0;
+		_tap_lowpass_state[c] = 0;
+		_tap_highpass_state[c] = 0;
+	}
+	updateVoicing();
+	_delay_seconds = 0;
 	_decay = .5;
 	_level = 1;
 }
-Delay_Buffer::Delay_Buffer(double decay, double level, double duration, jack_nframes_t frame_size)
+Delay_Buffer::~Delay_Buffer()
+{
+	dspFree(_buffer);
+	dspFree(_wet_buffer);
+}
+
+Delay_Buffer::Delay_Buffer(Delay_Buffer &&other) : Delay_Buffer()
+{
+	*this = std::move(other);
+}
+
+Delay_Buffer &Delay_Buffer::operator=(Delay_Buffer &&other)
+{
+	if (this == &other) return *this;
+	
+	dspFree(_buffer);
+	dspFree(_wet_buffer);
+	
+	_fx_chain = other._fx_chain;
+	_pipeline = other._pipeline;
+	_echo_fx = other._echo_fx;
+	_echo_fx_arg = other._echo_fx_arg;
+	_write_ind = other._write_ind;
+	_buffer = other._buffer;
+	_ring_size = other._ring_size;
+	_ring_mask = other._ring_mask;
+	_max_seconds = other._max_seconds;
+	_channels = other._channels;
+	_frame_size = other._frame_size;
+	_wet_buffer = other._wet_buffer;
+	_sample_rate = other._sample_rate;
+	_active = other._active;
+	_delay = other._delay;
+	_target = other._target;
+	_fade_from = other._fade_from;
+	_fade_left = other._fade_left;
+	_fade_length = other._fade_length;
+	_glide_pole = other._glide_pole;
+	_change = other._change;
+	for (int t = 0; t < DELAY_MAX_TAPS; t++) {
+		_taps[t] = other._taps[t];
+	}
+	_tap_count = other._tap_count;
+	_lowpass_hz = other._lowpass_hz;
+	_highpass_hz = other._highpass_hz;
+	_drive = other._drive;
+	_wow_depth = other._wow_depth;
+	_lowpass_coefficient = other._lowpass_coefficient;
+	_highpass_coefficient = other._highpass_coefficient;
+	_drive_curve = other._drive_curve;
+	_wow_samples = other._wow_samples;
+	_flutter_samples = other._flutter_samples;
+	_wow_phase = other._wow_phase;
+	_flutter_phase = other._flutter_phase;
+	_wow_offset = other._wow_offset;
+	for (int c = 0; c < FX_MAX_CHANNELS; c++) {
+		_lowpass_state[c] = other._lowpass_state[c];
+		_highpass_state[c] = other._highpass_state[c];
+		_tap_lowpass_state[c] = other._tap_lowpass_state[c];
+		_tap_highpass_state[c] = other._tap_highpass_state[c];
+	}
+	_delay_seconds = other._delay_seconds;
+	_decay = other._decay;
+	_level = other._level;
+	
+	other._buffer = NULL;
+	other._ring_size = 0;
+	other._ring_mask = 0;
+	other._wet_buffer = NULL;
+	other._channels = 0;
+	other._active = 0;
+	return *this;
+}
+
+Delay_Buffer::Delay_Buffer(double decay, double level, double duration, jack_nframes_t frame_size, jack_nframes_t sample_rate, int channels, double max_seconds)
 {
-	_buffer_ind = 0;
+	_pipeline = NULL;
+	_echo_fx = NULL;
+	_echo_fx_arg = NULL;
+	_write_ind = 0;
+	_max_seconds = duration > max_seconds ? duration : max_seconds;
+	_ring_size = ringSizeFor(_max_seconds, sample_rate);
+	_ring_mask = _ring_size - 1;
+	_buffer = dspAlloc<jack_default_audio_sample_t>(ringSamples(_ring_size, channels));
+	_channels = channels;
 	_frame_size = frame_size;
-	_output_buffer = new jack_default_audio_sample_t[frame_size];
+	_sample_rate = sample_rate;
+	_wet_buffer = dspAlloc<jack_default_audio_sample_t>(channels * frame_size);
+	_fade_left = 0;
+	_change = DELAY_CROSSFADE;
+	_tap_count = 0;
+	_lowpass_hz = 0;
+	_highpass_hz = 0;
+	_drive = 0;
+	_wow_depth = 0;
+	_wow_phase = 0;
+	_flutter_phase = 0;
+	_wow_offset = 0;
+	for (int c = 0; c < FX_MAX_CHANNELS; c++) {
+		_lowpass_state[c] = 0;
+		_highpass_state[c] = 0;
+		_tap_lowpass_state[c] = 0;
+		_tap_highpass_state[c] = 0;
+	}
+	_delay_seconds = duration;
 	
-	setDelayLength(duration);
+	setSampleRate(sample_rate);
 	setDecay(decay);
 	setLevel(level);
 }
 
 void Delay_Buffer::setDelayLength(double seconds)
+{
+	setDelayTarget(seconds, 0);
+}
+
+void Delay_Buffer::setDelayTarget(double seconds, int jump)
 {
 	if (seconds == 0) _active = 0;
 	else _active = 1;
 	
-	uint32_t samples_per_frame = (seconds * SAMPLE_RATE) / _frame_size;
-	_max_buffer_ind = samples_per_frame * _frame_size - 1;
-	if (_max_buffer_ind == -1) _max_buffer_ind = _frame_size - 1;
-	printf("Max buffer ind: %d\n", _max_buffer_ind);
+	_delay_seconds = seconds;
+	// the interpolator reads one sample before the read head, which must still be in the ring
+	const double samples = seconds * _sample_rate;
+	const double longest = (double) _ring_size - 1;
+	if (samples >= longest) _target = longest;
+	else _target = samples;
+	if (_target < DELAY_MIN_SAMPLES) _target = DELAY_MIN_SAMPLES;
+	
+	// only the read head moves, so the echoes already in the ring are kept
+	if (jump) {
+		_delay = _target;
+		_fade_left = 0;
+	}
+	rt_log.log(LOG_DELAY_SAMPLES, _target);
+}
+
+void Delay_Buffer::setSampleRate(jack_nframes_t rate)
+{
+	_sample_rate = rate;
+	_fade_length = DELAY_CROSSFADE_SECONDS * rate;
+	_glide_pole = exp(-1.0 / (DELAY_GLIDE_SECONDS * rate));
+	updateVoicing();
+	setDelayTarget(_delay_seconds, 1);
+}
+
+uint32_t Delay_Buffer::ringSizeFor(double max_seconds, jack_nframes_t rate)
+{
+	if (max_seconds > DELAY_MAX_SECONDS) max_seconds = DELAY_MAX_SECONDS;
+	const double samples = max_seconds * rate + 1;
+	
+	uint32_t size = 2 * DELAY_MIN_SAMPLES;
+	while (size < samples) size <<= 1;
+	return size;
+}
+
+jack_default_audio_sample_t *Delay_Buffer::setRing(jack_default_audio_sample_t *ring, uint32_t ring_size, double max_seconds)
+{
+	jack_default_audio_sample_t *old = _buffer;
+	_buffer = ring;
+	_ring_size = ring_size;
+	_ring_mask = ring_size - 1;
+	_max_seconds = max_seconds;
+	
+	// nothing has been written to the new ring, so there is nothing to fade from
+	setDelayTarget(_delay_seconds, 1);
+	return old;
+}
+
+jack_default_audio_sample_t *Delay_Buffer::setFrameSize(jack_nframes_t frame_size, jack_default_audio_sample_t *wet_buffer)
+{
+	jack_default_audio_sample_t *old = _wet_buffer;
+	_wet_buffer = wet_buffer;
+	_frame_size = frame_size;
+	if (_pipeline != NULL) _pipeline->setPeriodSize(frame_size);
+	return old;
+}
+
+void Delay_Buffer::setTaps(int count)
+{
+	if (count > DELAY_MAX_TAPS) count = DELAY_MAX_TAPS;
+	if (count < 0) count = 0;
+	
+	for (int t = _tap_count; t < count; t++) {
+		_taps[t].subdivision = DELAY_QUARTER;
+		_taps[t].level = 1;
+		_taps[t].pan = 0;
+	}
+	_tap_count = count;
+}
+
+void Delay_Buffer::setTap(int tap, int subdivision, double level)
+{
+	if (tap < 0 || tap >= DELAY_MAX_TAPS || subdivision < DELAY_QUARTER || subdivision > DELAY_TRIPLET) return;
+	
+	_taps[tap].subdivision = subdivision;
+	if (level > 1.0)		_taps[tap].level = 1.0;
+	else if (level < 0.0)	_taps[tap].level = 0.0;
+	else					_taps[tap].level = level;
+}
+
+void Delay_Buffer::setTapPan(int tap, double pan)
+{
+	if (tap < 0 || tap >= DELAY_MAX_TAPS) return;
+	
+	if (pan > 1.0)			_taps[tap].pan = 1.0;
+	else if (pan < -1.0)	_taps[tap].pan = -1.0;
+	else					_taps[tap].pan = pan;
+}
+
+void Delay_Buffer::setFeedbackLowpass(double hz)
+{
+	_lowpass_hz = hz > 0 ? hz : 0;
+	updateVoicing();
+}
+
+void Delay_Buffer::setFeedbackHighpass(double hz)
+{
+	_highpass_hz = hz > 0 ? hz : 0;
+	updateVoicing();
+}
+
+void Delay_Buffer::setFeedbackDrive(double drive)
+{
+	if (drive > 1.0)		_drive = 1.0;
+	else if (drive < 0.0)	_drive = 0.0;
+	else					_drive = drive;
+	updateVoicing();
+}
+
+void Delay_Buffer::setWowFlutter(double depth)
+{
+	if (depth > 1.0)		_wow_depth = 1.0;
+	else if (depth < 0.0)	_wow_depth = 0.0;
+	else					_wow_depth = depth;
+	updateVoicing();
+}
+
+void Delay_Buffer::updateVoicing(void)
+{
+	// a cutoff at or above Nyquist passes everything, the same as no filter
+	const double nyquist = _sample_rate / 2.0;
+	_lowpass_coefficient = _lowpass_hz > 0 && _lowpass_hz < nyquist ? 1 - exp(-2 * M_PI * _lowpass_hz / _sample_rate) : 1;
+	_highpass_coefficient = _highpass_hz > 0 ? 1 - exp(-2 * M_PI * fmin(_highpass_hz, nyquist) / _sample_rate) : 0;
+	_drive_curve = _drive * DELAY_DRIVE_MAX;
+	_wow_samples = _wow_depth * DELAY_WOW_SECONDS * _sample_rate;
+	_flutter_samples = _wow_depth * DELAY_FLUTTER_SECONDS * _sample_rate;
 }
 
 void Delay_Buffer::setDecay(double decay)
@@ -145,21 +683,371 @@ void Delay_Buffer::setLevel(double level)
 	else 					_level = level;
 }
 
-void Delay_Buffer::newFrame(jack_default_audio_sample_t *sample)
+void Delay_Buffer::newFrame(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, jack_nframes_t nframes)
+{
+	if (_pipeline != NULL) {
+		newPipelinedFrame(in, out, nframes);
+		return;
+	}
+	
+	startFade();
+	
+	// longer periods are handled a frame at a time, so the wet buffer is always big enough,
+	// and a delay shorter than the period a piece at a time, so every echo read is already written
+	jack_nframes_t step = _frame_size;
+	const jack_nframes_t limit = readLimit();
+	if (step > limit) step = limit;
+	if (nframes > step) {
+		const jack_default_audio_sample_t *in_part[FX_MAX_CHANNELS];
+		jack_default_audio_sample_t *out_part[FX_MAX_CHANNELS];
+		
+		for (jack_nframes_t done = 0; done < nframes; done += step) {
+			for (int c = 0; c < _channels; c++) {
+				in_part[c] = in[c] + done;
+				out_part[c] = out[c] + done;
+			}
+			newFrame(in_part, out_part, nframes - done < step ? nframes - done : step);
+		}
+		return;
+	}
+	
+	jack_default_audio_sample_t *wet[FX_MAX_CHANNELS];
+	for (int c = 0; c < _channels; c++) {
+		// the FX can write straight into the output unless that would overwrite the dry input
+		wet[c] = out[c] != in[c] ? out[c] : _wet_buffer + c * _frame_size;
+	}
+	echoFrame(in, wet, nframes);
+	
+	// run the echo through the FX a whole frame at a time, then mix in the dry signal
+	if (_active == 1 && _echo_fx != NULL) {
+		_echo_fx(_echo_fx_arg, wet, nframes);
+	} else if (_active == 1 && _fx_chain != NULL) {
+		_fx_chain->process(wet, wet, _channels, nframes);
+	} else if (_active != 1) {
+		for (int c = 0; c < _channels; c++) {
+			memset(wet[c], 0, sizeof(jack_default_audio_sample_t) * nframes);
+		}
+	}
+	
+	const float level = _level;
+	for (int c = 0; c < _channels; c++) {
+		for (jack_nframes_t i = 0; i < nframes; i++) {
+			out[c][i] = wet[c][i] * level + in[c][i];
+		}
+	}
+}
+
+void Delay_Buffer::startFade(void)
+{
+	if (_change == DELAY_CROSSFADE && _fade_left == 0 && _delay != _target) {
+		_fade_from = _delay;
+		_delay = _target;
+		_fade_left = _fade_length;
+	}
+}
+
+void Delay_Buffer::echoFrame(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *echo, jack_nframes_t nframes)
+{
+	startFade();
+	
+	// a delay shorter than the frame is read a piece at a time, so every echo read is already written
+	const jack_nframes_t limit = readLimit();
+	if (nframes > limit) {
+		const jack_default_audio_sample_t *in_part[FX_MAX_CHANNELS];
+		jack_default_audio_sample_t *echo_part[FX_MAX_CHANNELS];
+		
+		for (jack_nframes_t done = 0; done < nframes; done += limit) {
+			for (int c = 0; c < _channels; c++) {
+				in_part[c] = in[c] + done;
+				echo_part[c] = echo[c] + done;
+			}
+			echoFrame(in_part, echo_part, nframes - done < limit ? nframes - done : limit);
+		}
+		return;
+	}
+	
+	// a glide covers this frame's share of the remaining distance, never faster than the limit
+	const double start = _delay;
+	if (_change == DELAY_GLIDE && _delay != _target) {
+		double end = _target + (_delay - _target) * pow(_glide_pole, nframes);
+		const double most = DELAY_GLIDE_MAX_RATE * nframes;
+		if (end > start + most) end = start + most;
+		if (end < start - most) end = start - most;
+		if (fabs(end - _target) < 1e-3) end = _target;
+		_delay = end;
+	}
+	
+	// wow and flutter only ever lengthen the delay, so every read stays behind the write head
+	double from = start;
+	double to = _delay;
+	double fade_from = _fade_from;
+	double fade_to = _fade_from;
+	if (_wow_samples > 0 || _wow_offset != 0) {
+		from += _wow_offset;
+		fade_from += _wow_offset;
+		_wow_phase = fmod(_wow_phase + 2 * M_PI * DELAY_WOW_HZ * nframes / _sample_rate, 2 * M_PI);
+		_flutter_phase = fmod(_flutter_phase + 2 * M_PI * DELAY_FLUTTER_HZ * nframes / _sample_rate, 2 * M_PI);
+		_wow_offset = (_wow_samples * (1 - cos(_wow_phase)) + _flutter_samples * (1 - cos(_flutter_phase))) / 2;
+		to += _wow_offset;
+		fade_to += _wow_offset;
+		
+		// the head being faded out is on the same tape, so it sways along
+		const double longest = (double) _ring_size - 1;
+		if (from > longest) from = longest;
+		if (to > longest) to = longest;
+		if (fade_from > longest) fade_from = longest;
+		if (fade_to > longest) fade_to = longest;
+	}
+	
+	for (int c = 0; c < _channels; c++) {
+		jack_default_audio_sample_t *ring = _buffer + c * (_ring_size + DELAY_RING_GUARD) + 1;
+		if (_tap_count == 0) {
+			readEchoes(ring, from, to, fade_from, fade_to, echo[c], nframes);
+			writeRing(c, ring, in[c], echo[c], nframes);
+			continue;
+		}
+		
+		// the quarter note is fed back while the taps are heard; all are read before the write
+		jack_default_audio_sample_t feedback[DELAY_READ_CHUNK];
+		readEchoes(ring, from, to, fade_from, fade_to, feedback, nframes);
+		readTaps(ring, from, to, fade_from, fade_to, c, echo[c], nframes);
+		writeRing(c, ring, in[c], feedback, nframes);
+	}
+	_write_ind += nframes;
+	_fade_left = _fade_left > nframes ? _fade_left - nframes : 0;
+}
+
+/** Fraction of the delay a tap at `subdivision` (from Delay_Subdivision_types) sits at. */
+static inline double tapFraction(int subdivision)
+{
+	static const double fractions[] = { 1, .75, .5, 2.0 / 3 };
+	return fractions[subdivision];
+}
+
+jack_nframes_t Delay_Buffer::readLimit(void) const
+{
+	// the interpolator reads two samples past the read head, and they must already be written
+	double shortest = _delay < _target ? _delay : _target;
+	if (_fade_left > 0 && _fade_from < shortest) shortest = _fade_from;
+	
+	// taps read closer to the write head than the quarter note
+	double fraction = 1;
+	for (int t = 0; t < _tap_count; t++) {
+		fraction = fmin(fraction, tapFraction(_taps[t].subdivision));
+	}
+	shortest = fmax(shortest * fraction, DELAY_MIN_SAMPLES);
+	jack_nframes_t limit = (jack_nframes_t) shortest - 2;
+	
+	// a fade or the taps read into buffers on the stack
+	if ((_fade_left > 0 || _tap_count > 0) && limit > DELAY_READ_CHUNK) limit = DELAY_READ_CHUNK;
+	return limit;
+}
+
+/** Catmull-Rom weights for the point `t` of the way from x[0] to x[1], applied to x[-1]
+ * to x[2]. A `t` of 0 gives exactly x[0].
+ */
+static inline void cubicWeights(float t, float weights[4])
+{
+	const float t2 = t * t;
+	const float t3 = t2 * t;
+	weights[0] = -0.5f * t3 + t2 - 0.5f * t;
+	weights[1] = 1.5f * t3 - 2.5f * t2 + 1;
+	weights[2] = -1.5f * t3 + 2 * t2 + 0.5f * t;
+	weights[3] = 0.5f * t3 - 0.5f * t2;
+}
+
+/** Read `nframes` samples from a ring of `size`, a steady `delay` behind `write`. The weights are the
+ * same for every sample, so this is a 4 tap filter (see @ref simd "SIMD Kernels"), or a
+ * copy for a whole number of samples, over each contiguous span.
+ */
+static void readSteady(const jack_default_audio_sample_t *ring, uint32_t size, uint32_t write, double delay, jack_default_audio_sample_t *out, jack_nframes_t nframes)
+{
+	const double whole = ceil(delay);
+	const float t = whole - delay;
+	float w[4];
+	cubicWeights(t, w);
+	uint32_t read = write - (uint32_t) whole;
+	
+	while (nframes > 0) {
+		read &= size - 1;
+		const jack_nframes_t span = nframes < size - read ? nframes : size - read;
+		if (t == 0) {
+			memcpy(out, ring + read, sizeof(jack_default_audio_sample_t) * span);
+		} else {
+			simdKernels().cubic(ring + read, out, span, w);
+		}
+	
+		read += span;
+		out += span;
+		nframes -= span;
+	}
+}
+
+/** Read `nframes` samples from a ring of `size` while the delay moves steadily from `from` to `to`
+ * behind `write`. The guard samples let every position be masked without a wrap check.
+ */
+static void readGliding(const jack_default_audio_sample_t *ring, uint32_t size, uint32_t write, double from, double to, jack_default_audio_sample_t *out, jack_nframes_t nframes)
+{
+	const double step = (to - from) / nframes;
+	for (jack_nframes_t i = 0; i < nframes; i++) {
+		const double delay = from + step * i;
+		const double whole = ceil(delay);
+		const jack_default_audio_sample_t *x = ring + ((write + i - (uint32_t) whole) & (size - 1));
+		float w[4];
+		cubicWeights(whole - delay, w);
+		out[i] = w[0] * x[-1] + w[1] * x[0] + w[2] * x[1] + w[3] * x[2];
+	}
+}
+
+void Delay_Buffer::readEchoes(const jack_default_audio_sample_t *ring, double from, double to, double fade_from, double fade_to, jack_default_audio_sample_t *echo, jack_nframes_t nframes)
 {
-	if (_buffer_ind + _frame_size > _max_buffer_ind) {
-		_buffer_ind = 0;
+	if (from == to) readSteady(ring, _ring_size, _write_ind, from, echo, nframes);
+	else readGliding(ring, _ring_size, _write_ind, from, to, echo, nframes);
+	
+	if (_fade_left == 0) return;
+	
+	// fade linearly from the old head over to the new one already in `echo`
+	jack_default_audio_sample_t old[DELAY_READ_CHUNK];
+	if (fade_from == fade_to) readSteady(ring, _ring_size, _write_ind, fade_from, old, nframes);
+	else readGliding(ring, _ring_size, _write_ind, fade_from, fade_to, old, nframes);
+	const float step = 1.0f / _fade_length;
+	const float gain = 1 - _fade_left * step;
+	for (jack_nframes_t i = 0; i < nframes; i++) {
+		const float g = fminf(gain + i * step, 1.0f);
+		echo[i] = old[i] + (echo[i] - old[i]) * g;
 	}
+}
+
+void Delay_Buffer::readTaps(const jack_default_audio_sample_t *ring, double from, double to, double fade_from, double fade_to, int channel, jack_default_audio_sample_t *wet, jack_nframes_t nframes)
+{
+	memset(wet, 0, sizeof(jack_default_audio_sample_t) * nframes);
 	
-	for (uint16_t i = 0; i < _frame_size; i++) {
-		_buffer[_buffer_ind + i] = _buffer[_buffer_ind + i] * _decay;
-		*(_output_buffer + i) = (_active == 1 ? _fx_processor->process(_buffer[_buffer_ind + i]) * _level : 0) + *(sample + i); // add processFX to _buffer[_buffer_ind+i]
+	const int voiced = _lowpass_coefficient < 1 || _highpass_coefficient > 0 || _drive_curve > 0;
+	jack_default_audio_sample_t echo[DELAY_READ_CHUNK];
+	for (int t = 0; t < _tap_count; t++) {
+		const Delay_Tap &tap = _taps[t];
+		const double fraction = tapFraction(tap.subdivision);
+		readEchoes(ring, fmax(from * fraction, DELAY_MIN_SAMPLES), fmax(to * fraction, DELAY_MIN_SAMPLES),
+			fmax(fade_from * fraction, DELAY_MIN_SAMPLES), fmax(fade_to * fraction, DELAY_MIN_SAMPLES), echo, nframes);
 		
+		// panning only turns down the far side, so a centred tap is as loud as a single echo
+		double side = 1;
+		if (_channels > 1) side = channel % 2 == 0 ? fmin(1 - tap.pan, 1) : fmin(1 + tap.pan, 1);
+		const float gain = voiced ? tap.level * side : tap.level * side * _decay;
 		
-		_buffer[_buffer_ind + i] = _buffer[_buffer_ind + i] + *(sample + i); 
+		for (jack_nframes_t i = 0; i < nframes; i++) {
+			wet[i] += echo[i] * gain;
+		}
 	}
 	
-	_buffer_ind += _frame_size;
+	// the taps are heard through the same tape voicing as the feedback, decay included
+	if (voiced) voiceEchoes(_tap_lowpass_state[channel], _tap_highpass_state[channel], wet, nframes);
+}
+
+void Delay_Buffer::voiceEchoes(float &lowpass_state, float &highpass_state, jack_default_audio_sample_t *echo, jack_nframes_t nframes)
+{
+	const float decay = _decay;
+	const float lowpass = _lowpass_coefficient;
+	const float highpass = _highpass_coefficient;
+	const float curve = _drive_curve;
+	float lowpassed = lowpass_state;
+	float rumble = highpass > 0 ? highpass_state : 0; // none left over once the highpass is off
+	
+	// the filters depend on the sample before, so they run one sample at a time...
+	for (jack_nframes_t i = 0; i < nframes; i++) {
+		const float x = echo[i] * decay;
+		rumble += highpass * (x - rumble);
+		lowpassed += lowpass * ((x - rumble) - lowpassed);
+		echo[i] = lowpassed;
+	}
+	
+	// ...and the saturation, which does not, vectorizes on its own
+	for (jack_nframes_t i = 0; i < nframes; i++) {
+		echo[i] = echo[i] / (1 + curve * fabsf(echo[i]));
+	}
+	
+	lowpass_state = lowpassed;
+	highpass_state = rumble;
+}
+
+void Delay_Buffer::writeRing(int channel, jack_default_audio_sample_t *ring, const jack_default_audio_sample_t *dry, jack_default_audio_sample_t *echo, jack_nframes_t nframes)
+{
+	const float decay = _decay;
+	const uint32_t size = _ring_size;
+	uint32_t write = _write_ind;
+	
+	const int voiced = _lowpass_coefficient < 1 || _highpass_coefficient > 0 || _drive_curve > 0;
+	
+	while (nframes > 0) {
+		write &= _ring_mask;
+		const jack_nframes_t span = nframes < size - write ? nframes : size - write;
+		jack_default_audio_sample_t *to = ring + write;
+		if (!voiced) {
+			for (jack_nframes_t i = 0; i < span; i++) {
+				const jack_default_audio_sample_t decayed = echo[i] * decay;
+				echo[i] = decayed;
+				to[i] = decayed + dry[i];
+			}
+		} else {
+			voiceEchoes(_lowpass_state[channel], _highpass_state[channel], echo, span);
+			for (jack_nframes_t i = 0; i < span; i++) {
+				to[i] = echo[i] + dry[i];
+			}
+		}
+	
+		write += span;
+		dry += span;
+		echo += span;
+		nframes -= span;
+	}
+	
+	// keep the guard samples in step with the ends of the ring they mirror
+	ring[-1] = ring[size - 1];
+	ring[size] = ring[0];
+	ring[size + 1] = ring[1];
+}
+
+void Delay_Buffer::newPipelinedFrame(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, jack_nframes_t nframes)
+{
+	// the pipeline takes whole blocks, however the echo has to be read within each one
+	jack_nframes_t block = _pipeline->blockSize();
+	if (block > _frame_size) block = _frame_size;
+	if (nframes > block) {
+		const jack_default_audio_sample_t *in_part[FX_MAX_CHANNELS];
+		jack_default_audio_sample_t *out_part[FX_MAX_CHANNELS];
+		
+		for (jack_nframes_t done = 0; done < nframes; done += block) {
+			for (int c = 0; c < _channels; c++) {
+				in_part[c] = in[c] + done;
+				out_part[c] = out[c] + done;
+			}
+			newPipelinedFrame(in_part, out_part, nframes - done < block ? nframes - done : block);
+		}
+		return;
+	}
+	
+	jack_default_audio_sample_t *echo[FX_MAX_CHANNELS];
+	for (int c = 0; c < _channels; c++) {
+		echo[c] = _wet_buffer + c * _frame_size;
+	}
+	echoFrame(in, echo, nframes);
+	
+	// the echo goes through the chain and the dry signal rides along, so they come out together
+	const jack_default_audio_sample_t *source[2 * FX_MAX_CHANNELS];
+	for (int c = 0; c < _channels; c++) {
+		source[c] = echo[c];
+		source[_channels + c] = in[c];
+	}
+	_pipeline->process(source, nframes);
+	
+	const float level = _active == 1 ? _level : 0;
+	for (int c = 0; c < _channels; c++) {
+		const jack_default_audio_sample_t *wet = _pipeline->output(c);
+		const jack_default_audio_sample_t *late_dry = _pipeline->output(_channels + c);
+		for (jack_nframes_t i = 0; i < nframes; i++) {
+			out[c][i] = wet[i] * level + late_dry[i];
+		}
+	}
 }
 //*/
 
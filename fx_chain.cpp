@@ -0,0 +1,210 @@
+/** @file
+ * @addtogroup chain FX Chain
+ *
+ * @{
+ *
+ * @brief This file contains the class interface and implementation for a serial chain of
+ * FX, like a row of pedals on a pedalboard. Details follow.
+ *
+ * The chain owns a fixed number of slots, each holding its own `FX_Processor`. All of
+ * them are constructed up front, so changing a slot's FX, bypassing it or moving it to a
+ * different position only rewrites a few small fields and never allocates. That makes
+ * every operation safe to run on the audio thread between frames.
+ *
+ * Each frame is processed in place: the input is copied to the output once, and then
+ * every active slot runs over the output buffer in chain order. Slots set to `NONE` or
+ * bypassed are skipped entirely. With several channels, each slot processes all of them
+ * before the next slot runs.
+ */
+#pragma once
+
+#ifndef FX_CHAIN_CPP_
+#define FX_CHAIN_CPP_
+
+#include <stdint.h>
+#include <cstring>
+#include <jack/jack.h>
+
+#include "fx_processor.cpp"
+
+#define FX_CHAIN_SLOTS 8 ///< Number of FX slots in a chain
+
+class FX_Chain
+{
+	public:
+		/** Runs a block of samples through every active slot in chain order.
+		 *
+		 * `in` and `out` may point to the same buffer.
+		 *
+		 * @param in Pointer to the block of samples to process
+		 * @param out Pointer to where the processed samples are written
+		 * @param nframes The number of samples in the block
+		 */
+		void process(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes);
+
+		/** Runs the same block on several linked channels through every active slot.
+		 *
+		 * @param in One pointer per channel to the block of samples to process
+		 * @param out One pointer per channel to where the processed samples are written
+		 * @param channels Number of channels, no more than were passed to `setChannels`
+		 * @param nframes The number of samples in the block
+		 */
+		void process(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, int channels, jack_nframes_t nframes);
+
+		/** Runs a block in place through the active slots at chain positions `first` to
+		 * `last` - 1, so a chain can be split into pieces run one after another.
+		 */
+		void processPositions(int first, int last, jack_default_audio_sample_t *const *buffer, int channels, jack_nframes_t nframes);
+
+		/** Returns 1 if the slot at `position` in the chain runs, 0 if it is `NONE` or
+		 * bypassed.
+		 */
+		int activeAt(int position) const;
+
+		/** Sets how many channels every slot will be run on. Allocates, so call it before
+		 * audio starts.
+		 */
+		void setChannels(int channels);
+
+		/** Changes the FX in a slot.
+		 *
+		 * @param slot Slot number (0 to FX_CHAIN_SLOTS - 1), independent of its position
+		 * @param type An FX type defined in the FX_types enum
+		 */
+		void setSlotFx(int slot, FX_types type);
+
+		/** Sets a parameter for the FX in one slot, or in every slot if `slot` is -1. */
+		void setParam(int slot, FX_param_types param, fxparam value);
+
+		/** Bypasses (1) or re-enables (0) a slot without forgetting its FX. */
+		void setBypass(int slot, int bypass);
+
+		/** Moves the slot at position `from` in the chain to position `to`, shifting the
+		 * slots in between along by one.
+		 */
+		void moveSlot(int from, int to);
+
+		/** Recomputes every slot's coefficients for a new sampling rate. */
+		void setSampleRate(jack_nframes_t rate);
+
+		/** Chooses which slot `nextFx` changes. */
+		void selectSlot(int slot);
+
+		/** Switches the selected slot to the next FX (goes in order of the FX_types enum). */
+		void nextFx(void);
+
+		/** Returns the FX processor in a slot, for reading its settings. */
+		const FX_Processor &slot(int slot) const { return _slots[slot]; }
+
+		/** Initialize an empty chain: every slot is `NONE`, in slot order, and slot 0 is
+		 * selected.
+		 */
+		FX_Chain();
+
+	private:
+		static int validSlot(int slot) { return slot >= 0 && slot < FX_CHAIN_SLOTS; }
+
+		FX_Processor _slots[FX_CHAIN_SLOTS];
+		uint8_t _order[FX_CHAIN_SLOTS]; // slot number at each position in the chain
+		uint8_t _bypass[FX_CHAIN_SLOTS]; // indexed by slot number
+		int _selected;
+};
+
+FX_Chain::FX_Chain()
+{
+	for (int i = 0; i < FX_CHAIN_SLOTS; i++) {
+		_order[i] = i;
+		_bypass[i] = 0;
+	}
+	_selected = 0;
+}
+
+void FX_Chain::process(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes)
+{
+	process(&in, &out, 1, nframes);
+}
+
+void FX_Chain::process(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, int channels, jack_nframes_t nframes)
+{
+	for (int c = 0; c < channels; c++) {
+		if (out[c] != in[c]) memcpy(out[c], in[c], sizeof(jack_default_audio_sample_t) * nframes);
+	}
+
+	processPositions(0, FX_CHAIN_SLOTS, out, channels, nframes);
+}
+
+void FX_Chain::processPositions(int first, int last, jack_default_audio_sample_t *const *buffer, int channels, jack_nframes_t nframes)
+{
+	for (int i = first; i < last; i++) {
+		if (!activeAt(i)) continue;
+		_slots[_order[i]].process(buffer, buffer, channels, nframes);
+	}
+}
+
+int FX_Chain::activeAt(int position) const
+{
+	const int slot = _order[position];
+	return !_bypass[slot] && _slots[slot].getFx() != NONE;
+}
+
+void FX_Chain::setChannels(int channels)
+{
+	for (int i = 0; i < FX_CHAIN_SLOTS; i++) {
+		_slots[i].setChannels(channels);
+	}
+}
+
+void FX_Chain::setSlotFx(int slot, FX_types type)
+{
+	if (validSlot(slot)) _slots[slot].setFx(type);
+}
+
+void FX_Chain::setParam(int slot, FX_param_types param, fxparam value)
+{
+	if (slot == -1) {
+		for (int i = 0; i < FX_CHAIN_SLOTS; i++) {
+			_slots[i].setParam(param, value);
+		}
+	} else if (validSlot(slot)) {
+		_slots[slot].setParam(param, value);
+	}
+}
+
+void FX_Chain::setBypass(int slot, int bypass)
+{
+	if (validSlot(slot)) _bypass[slot] = bypass ? 1 : 0;
+}
+
+void FX_Chain::moveSlot(int from, int to)
+{
+	if (!validSlot(from) || !validSlot(to)) return;
+
+	uint8_t moving = _order[from];
+	if (from < to) {
+		memmove(&_order[from], &_order[from + 1], to - from);
+	} else {
+		memmove(&_order[to + 1], &_order[to], from - to);
+	}
+	_order[to] = moving;
+}
+
+void FX_Chain::setSampleRate(jack_nframes_t rate)
+{
+	for (int i = 0; i < FX_CHAIN_SLOTS; i++) {
+		_slots[i].setSampleRate(rate);
+	}
+}
+
+void FX_Chain::selectSlot(int slot)
+{
+	if (validSlot(slot)) _selected = slot;
+}
+
+void FX_Chain::nextFx(void)
+{
+	_slots[_selected].nextFx();
+}
+
+#endif
+
+/** @} */
@@ -0,0 +1,542 @@
+/** @file
+ * @addtogroup graph FX Graph
+ *
+ * @{
+ *
+ * @brief This file contains an FX graph with splits and merges, run in parallel across a
+ * worker pool. Details follow.
+ *
+ * An `FX_Chain` is a single row of pedals. A graph lets the signal split and join again:
+ * parallel wet and dry paths, two FX running side by side and mixed, a delay fed from part
+ * of the chain, and so on. Each node is an `FX_Processor` or a `Delay_Buffer`. A node sums
+ * everything connected into it, each connection with its own gain, and then runs its FX
+ * over that mix. The graph's output is the sum of whatever is connected to
+ * `FX_GRAPH_OUTPUT`. Connections must not form a loop.
+ *
+ * Nodes and connections are added first, and then `build` sorts the nodes so that each one
+ * comes after everything feeding it, and allocates every buffer. `process` allocates
+ * nothing. Without a worker pool it simply runs the nodes in that sorted order.
+ *
+ * With a @ref workers "Worker Pool", the nodes are scheduled by work stealing. Each thread
+ * owns a Chase-Lev deque of nodes that are ready to run. When a node finishes, it counts
+ * down each node it feeds, and any node whose inputs are all done is pushed onto the
+ * finishing thread's own deque. That thread takes it straight back, while its input is
+ * still in cache. A thread whose deque is empty steals the oldest node from another
+ * thread's deque instead. Independent branches therefore spread over the cores within one
+ * period, and a plain chain stays on one core without any hand-offs.
+ */
+#pragma once
+
+#ifndef FX_GRAPH_CPP_
+#define FX_GRAPH_CPP_
+
+#include <stdio.h>
+#include <cstring>
+#include <atomic>
+#include <jack/jack.h>
+
+#include "fx_processor.cpp"
+#include "delay_buffer.cpp"
+#include "worker_pool.cpp"
+
+#define FX_GRAPH_MAX_NODES 32 ///< Most nodes in a graph (must be a power of two)
+#define FX_GRAPH_MAX_INPUTS 8 ///< Most connections into one node, or into the output
+#define FX_GRAPH_INPUT -1 ///< Connect from this to feed a node with the graph's input
+#define FX_GRAPH_OUTPUT -2 ///< Connect to this to mix a node into the graph's output
+
+/** A Chase-Lev work-stealing deque of node numbers.
+ *
+ * Only the owning thread calls `push` and `pop`, at the bottom. Any thread may `steal` from
+ * the top. Each node is pushed at most once per period, so the deque never fills and never
+ * has to grow.
+ */
+class Work_Deque
+{
+	public:
+		void reset(void);
+		void push(int node);
+
+		/** @return The newest node, or -1 if the deque is empty */
+		int pop(void);
+
+		/** @return The oldest node, or -1 if the deque is empty or another thread won it */
+		int steal(void);
+
+		Work_Deque() { reset(); }
+
+	private:
+		alignas(64) std::atomic<int> _top;
+		std::atomic<int> _bottom;
+		std::atomic<int> _nodes[FX_GRAPH_MAX_NODES];
+};
+
+void Work_Deque::reset(void)
+{
+	_top.store(0, std::memory_order_relaxed);
+	_bottom.store(0, std::memory_order_relaxed);
+}
+
+void Work_Deque::push(int node)
+{
+	const int bottom = _bottom.load(std::memory_order_relaxed);
+	_nodes[bottom & (FX_GRAPH_MAX_NODES - 1)].store(node, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	_bottom.store(bottom + 1, std::memory_order_relaxed);
+}
+
+int Work_Deque::pop(void)
+{
+	const int bottom = _bottom.load(std::memory_order_relaxed) - 1;
+	_bottom.store(bottom, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	int top = _top.load(std::memory_order_relaxed);
+
+	if (top > bottom) {
+		_bottom.store(bottom + 1, std::memory_order_relaxed);
+		return -1;
+	}
+
+	int node = _nodes[bottom & (FX_GRAPH_MAX_NODES - 1)].load(std::memory_order_relaxed);
+	if (top == bottom) {
+		// last node left, so race any thieves for it
+		if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+			node = -1;
+		}
+		_bottom.store(bottom + 1, std::memory_order_relaxed);
+	}
+	return node;
+}
+
+int Work_Deque::steal(void)
+{
+	int top = _top.load(std::memory_order_acquire);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	const int bottom = _bottom.load(std::memory_order_acquire);
+	if (top >= bottom) return -1;
+
+	const int node = _nodes[top & (FX_GRAPH_MAX_NODES - 1)].load(std::memory_order_relaxed);
+	if (!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed)) {
+		return -1;
+	}
+	return node;
+}
+
+class FX_Graph
+{
+	public:
+		/** Add a node that runs one FX.
+		 *
+		 * @return The new node's number, or -1 if the graph is full
+		 */
+		int addFx(FX_types type);
+
+		/** Add a node that echoes its input (see @ref delay "Delay Buffer").
+		 *
+		 * @return The new node's number, or -1 if the graph is full
+		 */
+		int addDelay(double decay, double level, double seconds);
+
+		/** Feed the output of one node into another.
+		 *
+		 * Connecting the same two nodes again adds to the gain of the first connection.
+		 *
+		 * @param from Node number, or FX_GRAPH_INPUT for the graph's input
+		 * @param to Node number, or FX_GRAPH_OUTPUT for the graph's output
+		 * @param gain Amount of `from` mixed into `to`
+		 *
+		 * @return 0 on success, -1 if a node number is invalid or `to` has too many inputs
+		 */
+		int connect(int from, int to, float gain = 1);
+
+		/** Sort the nodes and allocate their buffers. Allocates, so call it before audio
+		 * starts, and again after adding nodes or connections.
+		 *
+		 * @param channels Number of linked channels, from 1 to FX_MAX_CHANNELS
+		 * @param max_frames Largest block `process` will run at once; longer ones are split
+		 * @param sample_rate The sampling rate of the audio
+		 *
+		 * @return 0 on success, -1 if the connections form a loop
+		 */
+		int build(int channels, jack_nframes_t max_frames, jack_nframes_t sample_rate);
+
+		/** Run independent nodes on a worker pool, or NULL to run them all on the calling
+		 * thread.
+		 */
+		void setWorkers(Worker_Pool *pool) { _pool = pool; }
+
+		/** Runs a block of samples through the graph.
+		 *
+		 * `in[c]` and `out[c]` may point to the same buffer.
+		 *
+		 * @param in One pointer per channel to the block of samples to process
+		 * @param out One pointer per channel to where the mixed output is written
+		 * @param nframes The number of samples in the block
+		 */
+		void process(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, jack_nframes_t nframes);
+
+		/** Runs a block of mono samples through the graph. Does nothing unless the graph
+		 * was built with one channel, since there is only one pointer to read from.
+		 */
+		void process(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes);
+
+		/** Runs a block through the graph in place, for `Delay_Buffer::setEchoFx`.
+		 *
+		 * @param graph The FX_Graph to run
+		 * @param buffer One pointer per channel to the block, replaced by the graph's output
+		 * @param nframes The number of samples in the block
+		 */
+		static void processEcho(void *graph, jack_default_audio_sample_t *const *buffer, jack_nframes_t nframes);
+
+		/** Sets a parameter for the FX in one node. */
+		void setParam(int node, FX_param_types param, fxparam value);
+
+		/** Recomputes every node's coefficients for a new sampling rate. */
+		void setSampleRate(jack_nframes_t rate);
+
+		int nodes(void) const { return _count; }
+
+		FX_Graph();
+		~FX_Graph();
+
+		FX_Graph(const FX_Graph &) = delete;
+		FX_Graph &operator=(const FX_Graph &) = delete;
+
+	private:
+		struct Edge
+		{
+			int from;
+			float gain;
+		};
+
+		struct Node
+		{
+			FX_Processor fx;
+			Delay_Buffer delay;
+			int is_delay;
+			double delay_settings[3]; // decay, level and seconds, applied by build
+
+			Edge inputs[FX_GRAPH_MAX_INPUTS];
+			int input_count;
+			int successors[FX_GRAPH_MAX_NODES];
+			int successor_count;
+			int dependencies; // inputs from other nodes
+
+			jack_default_audio_sample_t *buffer; // _max_frames per channel
+			std::atomic<int> waiting; // inputs not yet run this period
+		};
+
+		static int addEdge(Edge *edges, int &count, int from, float gain);
+		static void runThread(int thread, void *arg);
+		void processBlock(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, jack_nframes_t nframes);
+		void runNode(int node);
+		void mix(const Edge *edges, int count, jack_default_audio_sample_t *const *dest) const;
+
+		Node *_nodes[FX_GRAPH_MAX_NODES];
+		int _count;
+		int _order[FX_GRAPH_MAX_NODES]; // node numbers, each after everything that feeds it
+		Edge _outputs[FX_GRAPH_MAX_INPUTS];
+		int _output_count;
+
+		int _channels;
+		jack_nframes_t _max_frames;
+		int _built;
+
+		Worker_Pool *_pool;
+		Work_Deque _deques[WORKER_MAX_THREADS + 1]; // one per thread, the caller's last
+		alignas(64) std::atomic<int> _remaining; // nodes not yet run this period
+		int _threads;
+
+		// the block being processed, read by every thread
+		const jack_default_audio_sample_t *const *_in;
+		jack_nframes_t _nframes;
+};
+
+FX_Graph::FX_Graph()
+{
+	_count = 0;
+	_output_count = 0;
+	_channels = 1;
+	_max_frames = 0;
+	_built = 0;
+	_pool = NULL;
+	_remaining = 0;
+	_threads = 1;
+	_in = NULL;
+	_nframes = 0;
+}
+
+FX_Graph::~FX_Graph()
+{
+	for (int i = 0; i < _count; i++) {
+		dspFree(_nodes[i]->buffer);
+		delete _nodes[i];
+	}
+}
+
+int FX_Graph::addFx(FX_types type)
+{
+	if (_count == FX_GRAPH_MAX_NODES) return -1;
+
+	Node *node = new Node;
+	node->fx.setFx(type);
+	node->is_delay = 0;
+	node->input_count = 0;
+	node->successor_count = 0;
+	node->dependencies = 0;
+	node->buffer = NULL;
+	node->waiting = 0;
+
+	_nodes[_count] = node;
+	_built = 0;
+	return _count++;
+}
+
+int FX_Graph::addDelay(double decay, double level, double seconds)
+{
+	const int index = addFx(NONE);
+	if (index < 0) return -1;
+
+	_nodes[index]->is_delay = 1;
+	_nodes[index]->delay_settings[0] = decay;
+	_nodes[index]->delay_settings[1] = level;
+	_nodes[index]->delay_settings[2] = seconds;
+	return index;
+}
+
+int FX_Graph::addEdge(Edge *edges, int &count, int from, float gain)
+{
+	for (int i = 0; i < count; i++) {
+		if (edges[i].from == from) {
+			edges[i].gain += gain;
+			return 0;
+		}
+	}
+	if (count == FX_GRAPH_MAX_INPUTS) return -1;
+
+	// the graph's input goes first, so it is read before an in-place output overwrites it
+	if (from == FX_GRAPH_INPUT) {
+		memmove(&edges[1], &edges[0], sizeof(Edge) * count);
+		edges[0].from = from;
+		edges[0].gain = gain;
+	} else {
+		edges[count].from = from;
+		edges[count].gain = gain;
+	}
+	count++;
+	return 0;
+}
+
+int FX_Graph::connect(int from, int to, float gain)
+{
+	if (from != FX_GRAPH_INPUT && (from < 0 || from >= _count)) return -1;
+	if (to != FX_GRAPH_OUTPUT && (to < 0 || to >= _count)) return -1;
+
+	_built = 0;
+	if (to == FX_GRAPH_OUTPUT) return addEdge(_outputs, _output_count, from, gain);
+	return addEdge(_nodes[to]->inputs, _nodes[to]->input_count, from, gain);
+}
+
+int FX_Graph::build(int channels, jack_nframes_t max_frames, jack_nframes_t sample_rate)
+{
+	_channels = channels;
+	_max_frames = max_frames;
+
+	for (int i = 0; i < _count; i++) {
+		Node *node = _nodes[i];
+		node->successor_count = 0;
+		node->dependencies = 0;
+	}
+	for (int i = 0; i < _count; i++) {
+		Node *node = _nodes[i];
+		for (int e = 0; e < node->input_count; e++) {
+			const int from = node->inputs[e].from;
+			if (from == FX_GRAPH_INPUT) continue;
+			_nodes[from]->successors[_nodes[from]->successor_count++] = i;
+			node->dependencies++;
+		}
+	}
+
+	// Kahn's algorithm: repeatedly take a node whose inputs have all been placed
+	int placed = 0;
+	int remaining[FX_GRAPH_MAX_NODES];
+	for (int i = 0; i < _count; i++) {
+		remaining[i] = _nodes[i]->dependencies;
+		if (remaining[i] == 0) _order[placed++] = i;
+	}
+	for (int next = 0; next < placed; next++) {
+		const Node *node = _nodes[_order[next]];
+		for (int s = 0; s < node->successor_count; s++) {
+			if (--remaining[node->successors[s]] == 0) _order[placed++] = node->successors[s];
+		}
+	}
+	if (placed < _count) {
+		printf("FX graph has a loop, %d of %d nodes could not be ordered\n", _count - placed, _count);
+		return -1;
+	}
+
+	for (int i = 0; i < _count; i++) {
+		Node *node = _nodes[i];
+		dspFree(node->buffer);
+		node->buffer = dspAlloc<jack_default_audio_sample_t>(channels * max_frames);
+
+		node->fx.setChannels(channels);
+		node->fx.setSampleRate(sample_rate);
+		if (node->is_delay) {
+			node->delay = Delay_Buffer(node->delay_settings[0], node->delay_settings[1], node->delay_settings[2], max_frames, sample_rate, channels);
+			node->delay._fx_chain = NULL;
+		}
+	}
+
+	_built = 1;
+	return 0;
+}
+
+void FX_Graph::mix(const Edge *edges, int count, jack_default_audio_sample_t *const *dest) const
+{
+	for (int c = 0; c < _channels; c++) {
+		if (count == 0) {
+			memset(dest[c], 0, sizeof(jack_default_audio_sample_t) * _nframes);
+			continue;
+		}
+
+		for (int e = 0; e < count; e++) {
+			const jack_default_audio_sample_t *src = edges[e].from == FX_GRAPH_INPUT ? _in[c] : _nodes[edges[e].from]->buffer + c * _max_frames;
+			const float gain = edges[e].gain;
+
+			if (e == 0) {
+				for (jack_nframes_t i = 0; i < _nframes; i++) {
+					dest[c][i] = src[i] * gain;
+				}
+			} else {
+				for (jack_nframes_t i = 0; i < _nframes; i++) {
+					dest[c][i] += src[i] * gain;
+				}
+			}
+		}
+	}
+}
+
+void FX_Graph::runNode(int index)
+{
+	Node *node = _nodes[index];
+	jack_default_audio_sample_t *buffer[FX_MAX_CHANNELS];
+	for (int c = 0; c < _channels; c++) {
+		buffer[c] = node->buffer + c * _max_frames;
+	}
+
+	mix(node->inputs, node->input_count, buffer);
+
+	if (node->is_delay) {
+		node->delay.newFrame(buffer, buffer, _nframes);
+	} else if (node->fx.getFx() != NONE) {
+		node->fx.process(buffer, buffer, _channels, _nframes);
+	}
+}
+
+void FX_Graph::runThread(int thread, void *arg)
+{
+	FX_Graph *graph = static_cast<FX_Graph *>(arg);
+	Work_Deque &own = graph->_deques[thread];
+
+	while (graph->_remaining.load(std::memory_order_acquire) > 0) {
+		int index = own.pop();
+		for (int i = 1; index < 0 && i < graph->_threads; i++) {
+			index = graph->_deques[(thread + i) % graph->_threads].steal();
+		}
+		if (index < 0) {
+			// everything ready is being run; wait for those nodes to release their successors
+			Worker_Pool::cpuRelax();
+			continue;
+		}
+
+		graph->runNode(index);
+
+		const Node *node = graph->_nodes[index];
+		for (int s = 0; s < node->successor_count; s++) {
+			Node *next = graph->_nodes[node->successors[s]];
+			if (next->waiting.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+				own.push(node->successors[s]);
+			}
+		}
+		graph->_remaining.fetch_sub(1, std::memory_order_release);
+	}
+}
+
+void FX_Graph::processBlock(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, jack_nframes_t nframes)
+{
+	_in = in;
+	_nframes = nframes;
+
+	if (_pool == NULL || _pool->workers() == 0) {
+		for (int i = 0; i < _count; i++) {
+			runNode(_order[i]);
+		}
+	} else {
+		_threads = _pool->workers() + 1;
+		for (int t = 0; t < _threads; t++) {
+			_deques[t].reset();
+		}
+
+		// deal the nodes with no inputs from other nodes out to every thread
+		int roots = 0;
+		for (int i = 0; i < _count; i++) {
+			Node *node = _nodes[i];
+			node->waiting.store(node->dependencies, std::memory_order_relaxed);
+			if (node->dependencies == 0) _deques[roots++ % _threads].push(i);
+		}
+		_remaining.store(_count, std::memory_order_relaxed);
+
+		// the pool's barrier means every node has run once this returns
+		_pool->run(runThread, this, _threads);
+	}
+
+	mix(_outputs, _output_count, out);
+}
+
+void FX_Graph::process(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, jack_nframes_t nframes)
+{
+	if (!_built) return;
+
+	if (nframes <= _max_frames) {
+		processBlock(in, out, nframes);
+		return;
+	}
+
+	const jack_default_audio_sample_t *in_part[FX_MAX_CHANNELS];
+	jack_default_audio_sample_t *out_part[FX_MAX_CHANNELS];
+	for (jack_nframes_t done = 0; done < nframes; done += _max_frames) {
+		for (int c = 0; c < _channels; c++) {
+			in_part[c] = in[c] + done;
+			out_part[c] = out[c] + done;
+		}
+		processBlock(in_part, out_part, nframes - done < _max_frames ? nframes - done : _max_frames);
+	}
+}
+
+void FX_Graph::process(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes)
+{
+	if (_channels != 1) return;
+	process(&in, &out, nframes);
+}
+
+void FX_Graph::processEcho(void *graph, jack_default_audio_sample_t *const *buffer, jack_nframes_t nframes)
+{
+	static_cast<FX_Graph *>(graph)->process(buffer, buffer, nframes);
+}
+
+void FX_Graph::setParam(int node, FX_param_types param, fxparam value)
+{
+	if (node >= 0 && node < _count) _nodes[node]->fx.setParam(param, value);
+}
+
+void FX_Graph::setSampleRate(jack_nframes_t rate)
+{
+	for (int i = 0; i < _count; i++) {
+		_nodes[i]->fx.setSampleRate(rate);
+		if (_nodes[i]->is_delay) _nodes[i]->delay.setSampleRate(rate);
+	}
+}
+
+#endif
+
+/** @} */
@@ -31,18 +31,93 @@
  * frame, and can choose to do whatever he or she wants with these samples and then copies
  * them to an output port.
  *
+ * The process function does not talk to JACK directly. It is called by an audio backend
+ * (see @ref backend "Audio Backends"), selected with `--backend`. The default `jack`
+ * backend is the path described above. The `alsa` backend drives the sound card's mmap
+ * buffers directly, which removes the JACK server and one layer of latency. The `null`
+ * backend needs no audio hardware. It paces periods with a timer, or runs them back to
+ * back with `--flat-out`, so soak tests and benchmarks can run on machines without a
+ * sound card.
+ *
+ * @section offline Offline Rendering
+ * The pedal can also run without a sound card or JACK server. Running
+ * `main --render input.wav output.wav` pushes a recording through the same delay buffer
+ * and FX processor in blocks of a chosen size (`--block`) and writes the result as fast
+ * as the CPU allows. The FX, delay time, decay and level can be set on the command line.
+ * When it finishes, the renderer reports how many samples per second it processed and how
+ * many times faster than real time that is, which makes it a convenient benchmark for the
+ * DSP code.
+ *
+ * The pedal runs at whatever sampling rate the audio actually arrives at: the JACK
+ * server's rate when live, or the WAV file's rate when rendering. Delay times, tremolo
+ * rates and wah sweeps are kept in seconds and Hz and converted for that rate, and if the
+ * JACK server changes rate while running, the new rate is applied at the start of the next
+ * frame. Buffers are allocated for rates up to 96 kHz.
+ *
+ * The delay's memory is sized for the longest delay the pedal can be set to
+ * (`--max-delay`, 2 seconds by default and up to 60) at the rate the audio runs at, so a
+ * slapback preset stays small and an ambient one can echo for 10 seconds or more. When the
+ * rate changes, rings of the new size are allocated on JACK's notification thread and
+ * swapped in by pointer, and the echoes start over from silence.
+ *
+ * The JACK period size can also be changed while the pedal is running (e.g. from 256 down
+ * to 64 samples for lower latency). The delay's new wet buffer is allocated on JACK's
+ * notification thread and swapped in by pointer at the start of the next frame, so the
+ * audio thread never allocates or frees memory.
+ *
+ * A stereo (or up to 8 channel) rig runs in one pedal with `--channels`. Every channel has
+ * its own echo and filter memory, but they share one delay position, one set of FX
+ * parameters and one LFO. A tap tempo or FX change therefore moves all channels together,
+ * and they cannot drift apart the way two separate mono pedals would. The wah filters
+ * every channel in the same pass, one channel per SIMD lane.
+ *
+ * One client can also host a whole band with `--strips` (see @ref rack "Strip Rack").
+ * Each strip is a complete, independent pedal with its own `--channels` ports, FX chain
+ * and delay. With `--workers`, a fixed pool of threads pinned to their own cores shares out
+ * the strips each period, so extra musicians use extra cores without extra JACK clients.
+ * The UART controller drives the first strip.
+ *
+ * Presets heavier than one core can be built as an @ref graph "FX Graph" instead of a
+ * chain, with splits and merges such as parallel wet and dry paths. The same worker pool
+ * runs independent branches of the graph on different cores within one period. With
+ * `--graph`, a single strip's FX run this way instead of one after another: each FX is fed
+ * the whole echo and the branches are mixed back evenly, so `--fx reverb,tremolo` hears
+ * the reverb and the tremolo side by side. The controller still sets their parameters,
+ * but which FX run is fixed when the pedal starts.
+ *
+ * A single heavy chain can instead be pipelined with `--pipeline N` (see @ref pipeline
+ * "FX Pipeline"). The chain is cut into N stages that run side by side on the workers,
+ * each one period behind the last. The pedal sounds exactly the same, only N - 1 periods
+ * later, and that extra latency is reported to JACK on every port.
+ *
+ * `--harden` prepares the process for real-time use before audio starts (see @ref harden
+ * "RT Hardening"): every DSP buffer comes from one prefaulted arena, memory is locked with
+ * `mlockall`, the other threads are kept off the audio core, and the audio thread's
+ * priority is checked. Each step is reported on the console.
+ *
+ * Every period is timed against its deadline by the @ref loadmeter "Load Meter". Sending
+ * the pedal SIGUSR1 prints the median, 99th percentile and worst load since the last
+ * report, with the number of xruns, and a report is printed on exit and after every
+ * offline render. Rendering with `--block 64` on the target board is a quick way to see
+ * whether a preset is safe at that period size.
+ *
  * @section uart UART Controller
  * The user interface is controlled by a Tiva C. The Tiva C is connected to the Raspberry
  * Pi over UART. The Raspberry Pi reads the serial port to which the Tiva C sends UART
  * data on a separate thread from the FX processor, in order to maintain uninterrupted,
- * real-time audio processing.
+ * real-time audio processing. The UART thread never changes the FX processor or delay
+ * buffer itself. It pushes each change onto a lock-free single-producer/single-consumer
+ * queue (see @ref commands "Command Queue"), and the process function applies queued
+ * changes at the start of the next frame.
  *
  * The Tiva C has two buttons. The left button is used to cycle through the different FX,
  * which are covered in the @ref fx "FX Processor" section. The second button is used as
  * a tap tempo. This is a commonly used control in FX pedals. The user can tap the button
  * at the speed he/she wants the delay to occur. The controller will attempt to match the
- * echo rate to the exact rate at which the button was pressed. Some rounding will occur
- * due to the frame size, but this difference is usually unnoticeable. The controller will
+ * echo rate to the exact rate at which the button was pressed. The delay keeps a fraction
+ * of a sample, whatever the frame size, and a new tempo never clicks: by default the old
+ * echo fades into the new one over 30 ms, and with `--tempo-change glide` the delay slides
+ * to the new length like a tape machine, bending the echo's pitch on the way. The controller will
  * consider up to 4 most recent taps to calculate the tempo. If the button has not been
  * pressed for more than 2 seconds, the tap tempo will start fresh.
  * 
@@ -69,12 +144,38 @@
  * will have FX applied to them. Doing so can produce some unique sounds depending on how
  * the guitar is played.
  *
+ * With `--taps`, the delay becomes a rhythmic multi-tap delay. The tapped tempo is the
+ * quarter note, and up to 8 taps each sit at a quarter, dotted eighth, eighth or triplet of
+ * it, with their own level and pan. `--taps dotted,quarter` gives the dotted eighth plus
+ * quarter pattern in one pedal, and panning the taps apart on a stereo rig
+ * (`--taps dotted:1:-1,quarter:1:1 --channels 2`) bounces them from side to side.
+ *
+ * `--feedback` voices the repeats like an analog or tape delay. A lowpass in the feedback
+ * makes each repeat darker than the last, a highpass keeps the low end from building up,
+ * saturation rounds off loud repeats so high decay settings bloom instead of clipping, and
+ * wow and flutter let the delay time sway like a worn tape transport. `--feedback
+ * 2500:150:.6:.4` is a good starting point for a tape echo.
+ *
  * @section fx FX Processor
- * The FX Processor is responsible for processing audio on a sample by sample basis. The
- * class defines one function, `process`, which processes audio on a sample-by-sample
- * basis. The FX processing logic was separated from the delay buffer so that it can be
- * used independently of the delay if desired. The following sections explain which FX
- * the class is capable of processing.
+ * The FX Processor is responsible for processing the echoed audio. The class defines one
+ * function, `process`, which processes a whole frame of samples at a time. The FX type is
+ * only checked once per frame, and each FX runs its own tight loop over the samples so the
+ * compiler can keep its state in registers. The FX processing logic was separated from
+ * the delay buffer so that it can be used independently of the delay if desired. The
+ * following sections explain which FX the class is capable of processing.
+ *
+ * FX can be stacked the way pedals are on a pedalboard. The delay buffer runs the echo
+ * through an FX chain (see @ref chain "FX Chain"). A chain has 8 slots, each with its own
+ * FX processor, which run one after another over each frame. Slots can be bypassed,
+ * reordered or switched to a different FX while audio is running. All the slots are
+ * allocated when the chain is created, so none of these changes allocate memory on the
+ * audio thread. The left button cycles the FX in the selected slot (the first one by
+ * default).
+ *
+ * Pedals with a fixed set of FX can use the `Chain` template instead, e.g.
+ * `Chain<Overdrive, Wah, Tremolo>`. The whole chain then inlines into a single loop, and
+ * each sample stays in registers from the first FX to the last. `bench.cpp` compares the
+ * two kinds of chain.
  *
  * @subsection overdrive Overdrive
  * Overdrive is a classic effect used to simulate tubes on an amplifier reaching their
@@ -130,6 +231,13 @@
  *
  * where \f$Q_1\f$ determines the size of the pass band and is chosen to be 0.1 here [6].
  *
+ * Only the previous sample's \f$y_l\f$ and \f$y_b\f$ are ever needed, so the filter keeps
+ * just those two values as its state. The centre frequency \f$f_c\f$ sweeps from 500 Hz to
+ * 3500 Hz and then starts again. The sweep position is a 32 bit phase accumulator, and
+ * \f$F_1\f$ is interpolated from a quarter-wave sine table that the compiler builds, so
+ * creating a wah computes nothing and the sweep duration can be changed without
+ * recomputing anything.
+ *
  * 1. http://www.element14.com/community/community/raspberry-pi/raspberry-pi-accessories/wolfson_pi
  * 2. http://www.alsa-project.org/main/index.php/Main_Page
  * 3. http://jackaudio.org
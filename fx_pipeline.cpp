@@ -0,0 +1,269 @@
+/** @file
+ * @addtogroup pipeline FX Pipeline
+ *
+ * @{
+ *
+ * @brief This file contains a pipelined runner for an FX chain, which spreads a heavy
+ * chain over several cores in exchange for a few periods of latency. Details follow.
+ *
+ * The chain is cut into stages with roughly the same number of active slots in each. Every
+ * block, all the stages run at once on a @ref workers "Worker Pool": stage 0 processes
+ * this block's input, stage 1 processes what stage 0 produced from the last one, and so
+ * on. A block therefore comes out `stages - 1` blocks after it went in, and while one
+ * chain on one core can only process one block at a time, the pipeline has a block in
+ * every stage.
+ *
+ * Every block is the same length: the period, or an equal share of it when the period is
+ * longer than FX_PIPELINE_MAX_FRAMES. The caller pushes whole blocks however it has to cut
+ * up its own work, and a shorter block (like the end of a file) is padded with silence, so
+ * the blocks in flight always line up.
+ *
+ * Each stage hands its output to the next through a pair of preallocated buffers. In even
+ * periods a stage writes the first and the next stage reads the second, and in odd periods
+ * the other way round, so no stage ever reads a buffer that is being written. The pool's
+ * barrier at the end of each period is the only synchronization; there are no locks.
+ *
+ * Extra channels can be carried through the pipeline untouched, so a signal that has to
+ * stay lined up with the chain's output (like a delay's dry signal) comes out with exactly
+ * the same latency.
+ *
+ * The stages are cut when the pipeline is set up. Changing FX or moving slots afterwards
+ * still works, but the stages are not rebalanced. Only a period size change flushes the
+ * pipeline, which costs one pipeline's worth of silence.
+ */
+#pragma once
+
+#ifndef FX_PIPELINE_CPP_
+#define FX_PIPELINE_CPP_
+
+#include <cstring>
+#include <jack/jack.h>
+
+#include "fx_chain.cpp"
+#include "worker_pool.cpp"
+#include "rt_harden.cpp"
+
+#define FX_PIPELINE_MAX_STAGES 4 ///< Most stages a chain can be cut into
+#define FX_PIPELINE_MAX_FRAMES 2048 ///< Longest block each stage can hold
+
+class FX_Pipeline
+{
+	public:
+		/** Cut a chain into stages and allocate the hand-off buffers. Allocates, so call
+		 * it before audio starts, once the chain's FX are set.
+		 *
+		 * @param chain The chain to run
+		 * @param stages Number of stages, from 1 to FX_PIPELINE_MAX_STAGES
+		 * @param channels Number of channels the chain processes
+		 * @param carried Number of extra channels passed through untouched
+		 * @param period Period size, which sets the block length (see `setPeriodSize`)
+		 */
+		void setup(FX_Chain *chain, int stages, int channels, int carried, jack_nframes_t period);
+
+		/** Change the block length for a new period size, flushing every block in flight.
+		 * Does not allocate, so it can be called between periods on the audio thread.
+		 */
+		void setPeriodSize(jack_nframes_t period);
+
+		/** Block length the pipeline runs at for a period: the period itself, or the
+		 * longest equal share of it that fits in FX_PIPELINE_MAX_FRAMES.
+		 */
+		static jack_nframes_t blockFor(jack_nframes_t period);
+
+		/** Run the stages on a worker pool, or NULL to run them one after another on the
+		 * calling thread (same output, no speedup).
+		 */
+		void setWorkers(Worker_Pool *pool) { _pool = pool; }
+
+		/** Push one block into the pipeline and advance every stage by one block.
+		 *
+		 * @param in One pointer per channel, the chain's channels first and then the
+		 * carried ones
+		 * @param nframes The number of samples in the block, at most `blockSize()`; a
+		 * shorter block is padded with silence
+		 */
+		void process(const jack_default_audio_sample_t *const *in, jack_nframes_t nframes);
+
+		/** Returns the block leaving the pipeline for one channel, valid until the next
+		 * call to `process`.
+		 */
+		const jack_default_audio_sample_t *output(int channel) const { return _output[channel]; }
+
+		/** Number of samples in each block. */
+		jack_nframes_t blockSize(void) const { return _block; }
+
+		/** Number of samples between a block going in and coming out. */
+		jack_nframes_t latency(void) const { return latencyFor(_block); }
+
+		/** Number of samples of latency at a block length of `blockFor(period)`. */
+		jack_nframes_t latencyFor(jack_nframes_t period) const { return _stages > 1 ? (_stages - 1) * blockFor(period) : 0; }
+
+		FX_Pipeline();
+		~FX_Pipeline();
+
+		FX_Pipeline(const FX_Pipeline &) = delete;
+		FX_Pipeline &operator=(const FX_Pipeline &) = delete;
+
+	private:
+		static void runStage(int stage, void *arg);
+		void flush(void);
+
+		FX_Chain *_chain;
+		Worker_Pool *_pool;
+		int _stages;
+		int _channels; // processed by the chain
+		int _total; // processed plus carried
+		int _first[FX_PIPELINE_MAX_STAGES + 1]; // chain position each stage starts at
+
+		jack_default_audio_sample_t *_input; // this period's input, read by stage 0
+		jack_default_audio_sample_t *_buffers[FX_PIPELINE_MAX_STAGES][2]; // each stage's output
+		const jack_default_audio_sample_t *_output[2 * FX_MAX_CHANNELS];
+
+		unsigned int _period; // picks which half of each pair is written
+		int _filled; // blocks pushed since the last flush, up to _stages
+		jack_nframes_t _block; // samples in every block, however many the caller has
+};
+
+FX_Pipeline::FX_Pipeline()
+{
+	_chain = NULL;
+	_pool = NULL;
+	_stages = 0;
+	_channels = 0;
+	_total = 0;
+	_input = NULL;
+	for (int s = 0; s < FX_PIPELINE_MAX_STAGES; s++) {
+		_buffers[s][0] = _buffers[s][1] = NULL;
+	}
+	_period = 0;
+	_filled = 0;
+	_block = FX_PIPELINE_MAX_FRAMES;
+}
+
+FX_Pipeline::~FX_Pipeline()
+{
+	dspFree(_input);
+	for (int s = 0; s < FX_PIPELINE_MAX_STAGES; s++) {
+		dspFree(_buffers[s][0]);
+		dspFree(_buffers[s][1]);
+	}
+}
+
+void FX_Pipeline::setup(FX_Chain *chain, int stages, int channels, int carried, jack_nframes_t period)
+{
+	if (stages < 1) stages = 1;
+	if (stages > FX_PIPELINE_MAX_STAGES) stages = FX_PIPELINE_MAX_STAGES;
+
+	_chain = chain;
+	_stages = stages;
+	_channels = channels;
+	_total = channels + carried;
+
+	// give each stage an equal share of the active slots
+	int active = 0;
+	for (int i = 0; i < FX_CHAIN_SLOTS; i++) {
+		active += chain->activeAt(i);
+	}
+	_first[0] = 0;
+	for (int s = 1, seen = 0, i = 0; s < stages; s++) {
+		while (i < FX_CHAIN_SLOTS && seen < s * active / stages) {
+			seen += chain->activeAt(i++);
+		}
+		_first[s] = i;
+	}
+	_first[stages] = FX_CHAIN_SLOTS;
+
+	dspFree(_input);
+	_input = dspAlloc<jack_default_audio_sample_t>(_total * FX_PIPELINE_MAX_FRAMES);
+	for (int s = 0; s < FX_PIPELINE_MAX_STAGES; s++) {
+		dspFree(_buffers[s][0]);
+		dspFree(_buffers[s][1]);
+		_buffers[s][0] = _buffers[s][1] = NULL;
+		if (s >= stages) continue;
+		_buffers[s][0] = dspAlloc<jack_default_audio_sample_t>(_total * FX_PIPELINE_MAX_FRAMES);
+		_buffers[s][1] = dspAlloc<jack_default_audio_sample_t>(_total * FX_PIPELINE_MAX_FRAMES);
+	}
+
+	_period = 0;
+	_filled = 0;
+	_block = blockFor(period);
+}
+
+jack_nframes_t FX_Pipeline::blockFor(jack_nframes_t period)
+{
+	// the smallest number of equal blocks that each fit
+	jack_nframes_t blocks = (period + FX_PIPELINE_MAX_FRAMES - 1) / FX_PIPELINE_MAX_FRAMES;
+	if (blocks == 0) return 1;
+	while (period % blocks != 0) blocks++;
+	return period / blocks;
+}
+
+void FX_Pipeline::setPeriodSize(jack_nframes_t period)
+{
+	const jack_nframes_t block = blockFor(period);
+	if (block == _block) return;
+
+	flush();
+	_block = block;
+}
+
+void FX_Pipeline::flush(void)
+{
+	for (int s = 0; s < _stages; s++) {
+		memset(_buffers[s][0], 0, sizeof(jack_default_audio_sample_t) * _total * FX_PIPELINE_MAX_FRAMES);
+		memset(_buffers[s][1], 0, sizeof(jack_default_audio_sample_t) * _total * FX_PIPELINE_MAX_FRAMES);
+	}
+	_filled = 0;
+}
+
+void FX_Pipeline::runStage(int stage, void *arg)
+{
+	FX_Pipeline *pipeline = static_cast<FX_Pipeline *>(arg);
+	const unsigned int half = pipeline->_period & 1;
+	const jack_nframes_t nframes = pipeline->_block;
+
+	// stage 0 takes this block's input; the others take what the stage before wrote from the last one
+	const jack_default_audio_sample_t *source = stage == 0 ? pipeline->_input : pipeline->_buffers[stage - 1][half ^ 1];
+	jack_default_audio_sample_t *dest = pipeline->_buffers[stage][half];
+
+	jack_default_audio_sample_t *channel[2 * FX_MAX_CHANNELS];
+	for (int c = 0; c < pipeline->_total; c++) {
+		channel[c] = dest + c * FX_PIPELINE_MAX_FRAMES;
+		memcpy(channel[c], source + c * FX_PIPELINE_MAX_FRAMES, sizeof(jack_default_audio_sample_t) * nframes);
+	}
+
+	// until the first block reaches this stage there is only silence, which must not move the FX on
+	if (stage >= pipeline->_filled) return;
+
+	pipeline->_chain->processPositions(pipeline->_first[stage], pipeline->_first[stage + 1], channel, pipeline->_channels, nframes);
+}
+
+void FX_Pipeline::process(const jack_default_audio_sample_t *const *in, jack_nframes_t nframes)
+{
+	if (nframes > _block) nframes = _block;
+	if (_filled < _stages) _filled++;
+
+	for (int c = 0; c < _total; c++) {
+		jack_default_audio_sample_t *input = _input + c * FX_PIPELINE_MAX_FRAMES;
+		memcpy(input, in[c], sizeof(jack_default_audio_sample_t) * nframes);
+		memset(input + nframes, 0, sizeof(jack_default_audio_sample_t) * (_block - nframes));
+	}
+
+	if (_pool != NULL) {
+		_pool->run(runStage, this, _stages);
+	} else {
+		for (int s = 0; s < _stages; s++) {
+			runStage(s, this);
+		}
+	}
+
+	const jack_default_audio_sample_t *last = _buffers[_stages - 1][_period & 1];
+	for (int c = 0; c < _total; c++) {
+		_output[c] = last + c * FX_PIPELINE_MAX_FRAMES;
+	}
+	_period++;
+}
+
+#endif
+
+/** @} */
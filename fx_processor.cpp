@@ -17,13 +17,12 @@
 #include <jack/jack.h>
 #include <cmath>
 #include <stdlib.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <cstring>
 
-
-// 2 seconds * 44100 Hz
-#define BUFFER_CAPACITY 88200 ///< Maximum size in samples of the delay buffer
-#define SAMPLE_RATE 	44100 ///< Sampling rate of the sound card
+#include "rt_log.cpp"
+#include "fx_stages.cpp"
 
 enum FX_types { NONE, OVERDRIVE, DISTORTION, REVERB, TREMOLO, WAH }; ///< Different types of FX
 
@@ -47,16 +46,39 @@ enum FX_param_types {
 class FX_Processor
 {
 	public:
-		/** Runs the current FX on a sample by sample basis.
+		/** Runs the current FX over a block of samples.
+		 *
+		 * The FX type is resolved once per block and the selected FX stage (see
+		 * @ref stages "FX Stages") runs a tight loop over the samples with its state held
+		 * in locals, so the compiler is free to keep it in registers (and to vectorize
+		 * the stateless FX). `in` and `out` may point to the same buffer for in-place
+		 * processing.
+		 *
+		 * @param in Pointer to the block of samples to process
+		 * @param out Pointer to where the processed samples are written
+		 * @param nframes The number of samples in the block
+		 */
+		void process(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes);
+		
+		/** Runs the current FX over the same block on several linked channels.
 		 *
-		 * This function should be called for each sample in the frame. It will output
-		 * the processed frame based on what the selected FX is.
+		 * Every channel shares the FX's parameters and its LFO or counter, so the
+		 * channels stay in step. `in[c]` and `out[c]` may point to the same buffer.
 		 *
-		 * @param sample The sample to process
+		 * @param in One pointer per channel to the block of samples to process
+		 * @param out One pointer per channel to where the processed samples are written
+		 * @param channels Number of channels, no more than were passed to `setChannels`
+		 * @param nframes The number of samples in the block
+		 */
+		void process(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, int channels, jack_nframes_t nframes);
+		
+		/** Sets how many channels the FX will be run on.
+		 *
+		 * This allocates per-channel buffers, so it must be called before audio starts.
 		 *
-		 * @return Processed sample
+		 * @param channels Number of channels, from 1 to FX_MAX_CHANNELS
 		 */
-		jack_default_audio_sample_t process(jack_default_audio_sample_t sample);
+		void setChannels(int channels);
 		
 		/** Changes the FX to a type defined by the FX_types enum
 		 *
@@ -75,49 +97,38 @@ class FX_Processor
 		 */
 		void setParam(FX_param_types param, fxparam value);
 		
+		/** Recomputes every FX's coefficients for a new sampling rate.
+		 *
+		 * Parameters are kept in seconds and Hz, so each FX keeps the same timing and
+		 * pitch at any rate. Buffers are preallocated for MAX_SAMPLE_RATE, so this does
+		 * not allocate and is safe to call between frames on the audio thread.
+		 *
+		 * @param rate Sampling rate in Hz, up to MAX_SAMPLE_RATE
+		 */
+		void setSampleRate(jack_nframes_t rate);
+		
 		/** Switch to the next FX (goes in order of the FX_types enum). */
 		void nextFx(void);
 		
+		/** Returns the FX type currently selected. */
+		FX_types getFx(void) const { return _fx_type; }
+		
 		/** Initialize the FX_Processor with a given type defined in FX_types enum. */
-		FX_Processor(FX_types type);
+		FX_Processor(FX_types type = NONE);
 	private:
 		FX_types _fx_type;
 		fxparam _fx_params[LAST_PARAM - NO_PARAM];
 		
-		// trem members
-		uint32_t _trem_counter;
-		uint32_t _max_trem_count;
-		int _trem_state;
-		
-		// overdrive members
-		double _od_k;
-		
-		// reverb members
-		jack_default_audio_sample_t *_rv_buf;
-		uint32_t _rv_counter;
-		uint32_t _rv_max_ind;
-		
-		// wah members
-		jack_default_audio_sample_t _wah_yh[BUFFER_CAPACITY];
-		jack_default_audio_sample_t _wah_yb[BUFFER_CAPACITY];
-		jack_default_audio_sample_t _wah_yl[BUFFER_CAPACITY];
-		jack_default_audio_sample_t _wah_F1[BUFFER_CAPACITY];
-		uint32_t _wah_max_ind;
-		uint32_t _wah_counter;
+		Overdrive _overdrive;
+		Distortion _distortion;
+		Reverb _reverb;
+		Tremolo _tremolo;
+		Wah _wah;
 };
 
 FX_Processor::FX_Processor(FX_types type)
 {
 	setFx(type);
-	_trem_counter = 0;
-	_trem_state = 1;
-	
-	uint32_t rv_buf_size = SAMPLE_RATE * .2;
-	_rv_buf = new jack_default_audio_sample_t[rv_buf_size]();
-	_rv_counter = 0;
-	_rv_max_ind = rv_buf_size - 1;
-	
-	_wah_counter = 0;
 	
 	setParam(OD_DRIVE, 1);
 	setParam(TR_RATE, .2);
@@ -127,71 +138,53 @@ FX_Processor::FX_Processor(FX_types type)
 	setParam(WAH_DURATION, 1.5);
 }
 
-jack_default_audio_sample_t FX_Processor::process(jack_default_audio_sample_t sample)
+void FX_Processor::process(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes)
+{
+	process(&in, &out, 1, nframes);
+}
+
+void FX_Processor::process(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, int channels, jack_nframes_t nframes)
 {
 	switch (_fx_type) {
-		case NONE:
-			return sample;
-			break;
 		case OVERDRIVE:
-			sample = (1 + _od_k) * sample / (1 + _od_k * abs(sample));
-			
-			return sample;
+			_overdrive.processChannels(in, out, channels, nframes);
 			break;
 		case DISTORTION:
-			sample = 5 * _fx_params[DS_DIST] * sample;
-			if (sample > 0.2) {
-				sample = 0.2;
-			} else if (sample < -0.2) {
-				sample = -0.2;
-			}
-			
-			return sample;
+			_distortion.processChannels(in, out, channels, nframes);
 			break;
 		case REVERB:
-			_rv_buf[_rv_counter] = _fx_params[RV_DECAY]*_rv_buf[_rv_counter] + sample;
-			
-			sample = _rv_buf[_rv_counter];
-			
-			if (++_rv_counter > _rv_max_ind) _rv_counter = 0;
-			
-			return sample;
+			_reverb.processChannels(in, out, channels, nframes);
 			break;
 		case TREMOLO:
-			_trem_counter++;
-			if (_trem_counter == _max_trem_count) {
-				_trem_state = !_trem_state;
-				_trem_counter = 0;
-			}
-			
-			if (_trem_state == 1) {
-				return sample;
-			} else {
-				return _fx_params[TR_OFF_VOLUME] * sample;
-			}
+			_tremolo.processChannels(in, out, channels, nframes);
 			break;
 		case WAH:
-			if (_wah_counter == 0) {
-				_wah_yh[_wah_counter] = sample;
-				_wah_yb[_wah_counter] = 0;
-				_wah_yl[_wah_counter] = 0;
-			} else {
-				_wah_yh[_wah_counter] = sample - _wah_yl[_wah_counter - 1] - 0.1 * _wah_yb[_wah_counter - 1];
-				_wah_yb[_wah_counter] = _wah_F1[_wah_counter] * _wah_yh[_wah_counter] + _wah_yb[_wah_counter - 1];
-				_wah_yl[_wah_counter] = _wah_F1[_wah_counter] * _wah_yb[_wah_counter] + _wah_yl[_wah_counter - 1];
-			}
-			
-			sample = _wah_yb[_wah_counter];
-			
-			if (++_wah_counter > _wah_max_ind) _wah_counter = 0;
-			return sample;
+			_wah.processChannels(in, out, channels, nframes);
 			break;
-		
+		case NONE:
 		default:
-			return sample;
+			for (int c = 0; c < channels; c++) {
+				if (out[c] != in[c]) memcpy(out[c], in[c], sizeof(jack_default_audio_sample_t) * nframes);
+			}
+			break;
 	}
 }
 
+void FX_Processor::setChannels(int channels)
+{
+	_reverb.setChannels(channels);
+}
+
+void FX_Processor::setSampleRate(jack_nframes_t rate)
+{
+	_overdrive.setSampleRate(rate);
+	_distortion.setSampleRate(rate);
+	_reverb.setSampleRate(rate);
+	_tremolo.setSampleRate(rate);
+	_wah.setSampleRate(rate);
+	rt_log.log(LOG_TREMOLO_LENGTH, _tremolo.max_count);
+}
+
 void FX_Processor::nextFx(void)
 {
 	if (_fx_type == WAH) {
@@ -206,37 +199,39 @@ void FX_Processor::setFx(FX_types type)
 	_fx_type = type;
 	
 	if (type == WAH) {
-		_wah_counter = 0;
-		printf("Now WAHing\n");
+		_wah.phase = 0;
+		rt_log.log(LOG_FX_WAH);
 	} else if (type == REVERB) {
-		_rv_counter = 0;
-		printf("Now VERBing\n");
+		_reverb.counter = 0;
+		rt_log.log(LOG_FX_REVERB);
 	} else if (type == TREMOLO) {
-		_trem_counter = 0;
-		printf("Now TREMing\n");
+		_tremolo.counter = 0;
+		rt_log.log(LOG_FX_TREMOLO);
 	} else if (type == OVERDRIVE) {
-		printf("Now ODing\n");
+		rt_log.log(LOG_FX_OVERDRIVE);
 	} else if (type == DISTORTION) {
-		printf("Now DISTing\n");
+		rt_log.log(LOG_FX_DISTORTION);
 	} else if (type == NONE) {
-		printf("NOFXing\n");
+		rt_log.log(LOG_FX_NONE);
 	}
 }
 
 void FX_Processor::setParam(FX_param_types param, fxparam value)
 {
 	if (param == TR_RATE) {
-		_max_trem_count = SAMPLE_RATE * value;
-		printf("Set tremolo frame length to %d\n", _max_trem_count);
+		_tremolo.setRate(value);
+		rt_log.log(LOG_TREMOLO_LENGTH, _tremolo.max_count);
+	} else if (param == TR_OFF_VOLUME) {
+		_tremolo.setOffVolume(value);
 	} else if (param == OD_DRIVE) {
-		_od_k = 2 * sin(((value * 100 + 1) / 101) * 3.14159/2);
-		printf("Set overdrive to %f\n", _od_k);
+		_overdrive.setDrive(value);
+		rt_log.log(LOG_OVERDRIVE_K, _overdrive.k);
+	} else if (param == DS_DIST) {
+		_distortion.setDistortion(value);
+	} else if (param == RV_DECAY) {
+		_reverb.setDecay(value);
 	} else if (param == WAH_DURATION) {
-		uint32_t samples = value * SAMPLE_RATE;
-		_wah_max_ind = samples;
-		for (uint32_t i = 0; i < samples; i = i + 1) {
-			_wah_F1[i] = 2*sin(3.14159*(((jack_default_audio_sample_t)i/(samples-1)) * 3000 + 500)/SAMPLE_RATE);
-		}
+		_wah.setDuration(value);
 	}
 	_fx_params[param] = value;
 }
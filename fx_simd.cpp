@@ -0,0 +1,297 @@
+/** @file
+ * @addtogroup simd SIMD Kernels
+ *
+ * @{
+ *
+ * @brief This file contains vectorized block kernels for the waveshaping FX (overdrive and
+ * distortion) and the delay's fractional read, with the best version picked at run time.
+ * Details follow.
+ *
+ * Each kernel exists as a portable scalar loop, and where the compiler can build them,
+ * as SSE and AVX2 versions for x86 development machines and a NEON version for the
+ * Raspberry Pi. What the CPU supports is checked once during static initialization,
+ * before `main` starts any threads, and `simdKernels` returns the fastest set of kernels
+ * that will run, falling back to scalar. The audio thread and the workers only ever read
+ * a finished table, so the first period neither probes the CPU nor waits on a lock.
+ *
+ * The AVX2 kernels finish their tails with the scalar loop rather than the SSE kernels.
+ * Calling legacy-encoded SSE code with the upper halves of the AVX registers dirty costs
+ * a state transition on many x86 cores.
+ *
+ * The x86 kernels divide exactly, and every kernel multiplies and adds in the same order
+ * as the scalar loop without fusing, so their output is bit-identical to it.
+ * 32-bit ARM has no vector divide, so the NEON overdrive uses a reciprocal estimate
+ * refined with two Newton-Raphson steps. That is accurate to within a few units in the
+ * last place. NEON kernels are only built when the compiler targets NEON
+ * (`-mfpu=neon` on 32-bit Raspbian, always on 64-bit ARM).
+ */
+#pragma once
+
+#ifndef FX_SIMD_CPP_
+#define FX_SIMD_CPP_
+
+#include <cmath>
+#include <jack/jack.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FX_SIMD_X86
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define FX_SIMD_NEON
+#if !defined(__aarch64__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+
+/** Overdrive kernel: out = (1 + k) * in / (1 + k * |in|) */
+typedef void (*Overdrive_Kernel)(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes, float k);
+
+/** Distortion kernel: out = clamp(gain * in, -limit, limit) */
+typedef void (*Distortion_Kernel)(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes, float gain, float limit);
+
+/** Cubic read kernel: out = w[0] * in[-1] + w[1] * in[0] + w[2] * in[1] + w[3] * in[2], for
+ * each sample. Reads one sample before `in` and two past the end.
+ */
+typedef void (*Cubic_Kernel)(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes, const float w[4]);
+
+/** One complete set of kernels for a given instruction set. */
+struct Simd_Kernels
+{
+	const char *name;
+	Overdrive_Kernel overdrive;
+	Distortion_Kernel distortion;
+	Cubic_Kernel cubic;
+};
+
+static void overdriveScalar(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes, float k)
+{
+	const float gain = 1 + k;
+	for (jack_nframes_t i = 0; i < nframes; i++) {
+		out[i] = gain * in[i] / (1 + k * fabsf(in[i]));
+	}
+}
+
+static void distortionScalar(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes, float gain, float limit)
+{
+	for (jack_nframes_t i = 0; i < nframes; i++) {
+		float sample = gain * in[i];
+		sample = sample > limit ? limit : sample;
+		sample = sample < -limit ? -limit : sample;
+		out[i] = sample;
+	}
+}
+
+static void cubicScalar(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes, const float w[4])
+{
+	const jack_default_audio_sample_t *before = in - 1;
+	for (jack_nframes_t i = 0; i < nframes; i++) {
+		out[i] = w[0] * before[i] + w[1] * in[i] + w[2] * in[i + 1] + w[3] * in[i + 2];
+	}
+}
+
+#ifdef FX_SIMD_X86
+
+__attribute__((target("sse2")))
+static void overdriveSSE(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes, float k)
+{
+	const __m128 vk = _mm_set1_ps(k);
+	const __m128 vgain = _mm_set1_ps(1 + k);
+	const __m128 one = _mm_set1_ps(1.0f);
+	const __m128 abs_mask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+	jack_nframes_t i = 0;
+
+	for (; i + 4 <= nframes; i += 4) {
+		__m128 x = _mm_loadu_ps(in + i);
+		__m128 den = _mm_add_ps(one, _mm_mul_ps(vk, _mm_and_ps(x, abs_mask)));
+		_mm_storeu_ps(out + i, _mm_div_ps(_mm_mul_ps(vgain, x), den));
+	}
+	overdriveScalar(in + i, out + i, nframes - i, k);
+}
+
+__attribute__((target("sse2")))
+static void distortionSSE(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes, float gain, float limit)
+{
+	const __m128 vgain = _mm_set1_ps(gain);
+	const __m128 hi = _mm_set1_ps(limit);
+	const __m128 lo = _mm_set1_ps(-limit);
+	jack_nframes_t i = 0;
+
+	for (; i + 4 <= nframes; i += 4) {
+		__m128 x = _mm_mul_ps(vgain, _mm_loadu_ps(in + i));
+		_mm_storeu_ps(out + i, _mm_max_ps(_mm_min_ps(x, hi), lo));
+	}
+	distortionScalar(in + i, out + i, nframes - i, gain, limit);
+}
+
+__attribute__((target("sse2")))
+static void cubicSSE(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes, const float w[4])
+{
+	const __m128 w0 = _mm_set1_ps(w[0]);
+	const __m128 w1 = _mm_set1_ps(w[1]);
+	const __m128 w2 = _mm_set1_ps(w[2]);
+	const __m128 w3 = _mm_set1_ps(w[3]);
+	jack_nframes_t i = 0;
+
+	for (; i + 4 <= nframes; i += 4) {
+		__m128 sum = _mm_mul_ps(w0, _mm_loadu_ps(in + i - 1));
+		sum = _mm_add_ps(sum, _mm_mul_ps(w1, _mm_loadu_ps(in + i)));
+		sum = _mm_add_ps(sum, _mm_mul_ps(w2, _mm_loadu_ps(in + i + 1)));
+		sum = _mm_add_ps(sum, _mm_mul_ps(w3, _mm_loadu_ps(in + i + 2)));
+		_mm_storeu_ps(out + i, sum);
+	}
+	cubicScalar(in + i, out + i, nframes - i, w);
+}
+
+__attribute__((target("avx2")))
+static void overdriveAVX2(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes, float k)
+{
+	const __m256 vk = _mm256_set1_ps(k);
+	const __m256 vgain = _mm256_set1_ps(1 + k);
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 abs_mask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7FFFFFFF));
+	jack_nframes_t i = 0;
+
+	for (; i + 8 <= nframes; i += 8) {
+		__m256 x = _mm256_loadu_ps(in + i);
+		__m256 den = _mm256_add_ps(one, _mm256_mul_ps(vk, _mm256_and_ps(x, abs_mask)));
+		_mm256_storeu_ps(out + i, _mm256_div_ps(_mm256_mul_ps(vgain, x), den));
+	}
+	overdriveScalar(in + i, out + i, nframes - i, k);
+}
+
+__attribute__((target("avx2")))
+static void distortionAVX2(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes, float gain, float limit)
+{
+	const __m256 vgain = _mm256_set1_ps(gain);
+	const __m256 hi = _mm256_set1_ps(limit);
+	const __m256 lo = _mm256_set1_ps(-limit);
+	jack_nframes_t i = 0;
+
+	for (; i + 8 <= nframes; i += 8) {
+		__m256 x = _mm256_mul_ps(vgain, _mm256_loadu_ps(in + i));
+		_mm256_storeu_ps(out + i, _mm256_max_ps(_mm256_min_ps(x, hi), lo));
+	}
+	distortionScalar(in + i, out + i, nframes - i, gain, limit);
+}
+
+__attribute__((target("avx2")))
+static void cubicAVX2(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes, const float w[4])
+{
+	const __m256 w0 = _mm256_set1_ps(w[0]);
+	const __m256 w1 = _mm256_set1_ps(w[1]);
+	const __m256 w2 = _mm256_set1_ps(w[2]);
+	const __m256 w3 = _mm256_set1_ps(w[3]);
+	jack_nframes_t i = 0;
+
+	for (; i + 8 <= nframes; i += 8) {
+		__m256 sum = _mm256_mul_ps(w0, _mm256_loadu_ps(in + i - 1));
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(w1, _mm256_loadu_ps(in + i)));
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(w2, _mm256_loadu_ps(in + i + 1)));
+		sum = _mm256_add_ps(sum, _mm256_mul_ps(w3, _mm256_loadu_ps(in + i + 2)));
+		_mm256_storeu_ps(out + i, sum);
+	}
+	cubicScalar(in + i, out + i, nframes - i, w);
+}
+
+#endif
+
+#ifdef FX_SIMD_NEON
+
+static void overdriveNEON(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes, float k)
+{
+	const float32x4_t vk = vdupq_n_f32(k);
+	const float32x4_t vgain = vdupq_n_f32(1 + k);
+	const float32x4_t one = vdupq_n_f32(1.0f);
+	jack_nframes_t i = 0;
+
+	for (; i + 4 <= nframes; i += 4) {
+		float32x4_t x = vld1q_f32(in + i);
+		float32x4_t den = vmlaq_f32(one, vk, vabsq_f32(x));
+#if defined(__aarch64__)
+		vst1q_f32(out + i, vdivq_f32(vmulq_f32(vgain, x), den));
+#else
+		float32x4_t recip = vrecpeq_f32(den);
+		recip = vmulq_f32(recip, vrecpsq_f32(den, recip));
+		recip = vmulq_f32(recip, vrecpsq_f32(den, recip));
+		vst1q_f32(out + i, vmulq_f32(vmulq_f32(vgain, x), recip));
+#endif
+	}
+	overdriveScalar(in + i, out + i, nframes - i, k);
+}
+
+static void distortionNEON(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes, float gain, float limit)
+{
+	const float32x4_t vgain = vdupq_n_f32(gain);
+	const float32x4_t hi = vdupq_n_f32(limit);
+	const float32x4_t lo = vdupq_n_f32(-limit);
+	jack_nframes_t i = 0;
+
+	for (; i + 4 <= nframes; i += 4) {
+		float32x4_t x = vmulq_f32(vgain, vld1q_f32(in + i));
+		vst1q_f32(out + i, vmaxq_f32(vminq_f32(x, hi), lo));
+	}
+	distortionScalar(in + i, out + i, nframes - i, gain, limit);
+}
+
+static void cubicNEON(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes, const float w[4])
+{
+	const float32x4_t w0 = vdupq_n_f32(w[0]);
+	const float32x4_t w1 = vdupq_n_f32(w[1]);
+	const float32x4_t w2 = vdupq_n_f32(w[2]);
+	const float32x4_t w3 = vdupq_n_f32(w[3]);
+	jack_nframes_t i = 0;
+
+	for (; i + 4 <= nframes; i += 4) {
+		float32x4_t sum = vmulq_f32(w0, vld1q_f32(in + i - 1));
+		sum = vaddq_f32(sum, vmulq_f32(w1, vld1q_f32(in + i)));
+		sum = vaddq_f32(sum, vmulq_f32(w2, vld1q_f32(in + i + 1)));
+		sum = vaddq_f32(sum, vmulq_f32(w3, vld1q_f32(in + i + 2)));
+		vst1q_f32(out + i, sum);
+	}
+	cubicScalar(in + i, out + i, nframes - i, w);
+}
+
+#endif
+
+/** The portable kernels, always available. */
+static const Simd_Kernels scalar_kernels = { "scalar", overdriveScalar, distortionScalar, cubicScalar };
+
+static Simd_Kernels selectKernels(void)
+{
+#ifdef FX_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2")) {
+		Simd_Kernels kernels = { "avx2", overdriveAVX2, distortionAVX2, cubicAVX2 };
+		return kernels;
+	}
+	if (__builtin_cpu_supports("sse2")) {
+		Simd_Kernels kernels = { "sse2", overdriveSSE, distortionSSE, cubicSSE };
+		return kernels;
+	}
+#endif
+#ifdef FX_SIMD_NEON
+#if !defined(__aarch64__)
+	if (getauxval(AT_HWCAP) & HWCAP_NEON)
+#endif
+	{
+		Simd_Kernels kernels = { "neon", overdriveNEON, distortionNEON, cubicNEON };
+		return kernels;
+	}
+#endif
+	return scalar_kernels;
+}
+
+// picked before main, so no DSP thread ever initializes it
+static const Simd_Kernels best_kernels = selectKernels();
+
+/** Returns the fastest kernels this CPU supports. */
+static const Simd_Kernels &simdKernels(void)
+{
+	return best_kernels;
+}
+
+#endif
+
+/** @} */
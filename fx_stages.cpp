@@ -0,0 +1,481 @@
+/** @file
+ * @addtogroup stages FX Stages
+ *
+ * @{
+ *
+ * @brief This file contains the DSP for each individual FX as a small self-contained stage.
+ * Details follow.
+ *
+ * Every stage has the same shape:
+ *
+ * - `tick(x)` processes one sample and is small enough to inline. The compile-time
+ *   `Chain` template strings several stages' `tick`s together in a single loop.
+ * - `process(in, out, nframes)` processes a whole block. Where the FX allows it, this loop
+ *   is split into branch-free runs. The overdrive and distortion blocks use the kernels
+ *   in @ref simd "SIMD Kernels".
+ * - `processChannels(in, out, channels, nframes)` processes the same block on several
+ *   channels, which is what `FX_Processor` calls once per frame. The channels are linked:
+ *   they share one set of parameters and one LFO or counter, so a stereo tremolo or wah
+ *   moves on both sides together. Only the filter and echo memories are kept per channel,
+ *   as arrays indexed by channel.
+ * - Setters take the user-facing parameter and precompute whatever the inner loop needs.
+ * - `setSampleRate(rate)` recomputes those precomputed values for a new sampling rate, so
+ *   times and frequencies stay the same whatever rate the sound card runs at. Buffers are
+ *   sized for MAX_SAMPLE_RATE up front, so this never allocates.
+ *
+ * Stages only hold a few scalars and small per-channel arrays (plus a pointer to the
+ * reverb's buffer), so copying one into a local at the top of a block is cheap. That lets
+ * the compiler keep the whole state in registers, since it no longer has to assume that
+ * writing an output sample might change it.
+ */
+#pragma once
+
+#ifndef FX_STAGES_CPP_
+#define FX_STAGES_CPP_
+
+#include <stdint.h>
+#include <cmath>
+#include <cstring>
+#include <utility>
+#include <jack/jack.h>
+
+#include "fx_simd.cpp"
+#include "rt_harden.cpp"
+
+#define DEFAULT_SAMPLE_RATE	44100 ///< Sampling rate assumed until the audio backend reports one
+#define MAX_SAMPLE_RATE		96000 ///< Highest sampling rate buffers are preallocated for
+
+#define FX_MAX_CHANNELS		8 ///< Most channels a stage can process at once
+#define REVERB_SECONDS		0.2 ///< Length of the reverb's echo
+#define REVERB_LENGTH	((uint32_t)(MAX_SAMPLE_RATE * REVERB_SECONDS)) ///< Reverb buffer samples per channel
+#define DISTORTION_LIMIT	0.2f ///< Level the distortion clips at
+#define SINE_TABLE_SIZE	1024 ///< Number of steps in the quarter-wave sine table
+#define WAH_MIN_FREQ	500 ///< Centre frequency in Hz at the start of the wah sweep
+#define WAH_MAX_FREQ	3500 ///< Centre frequency in Hz at the end of the wah sweep
+
+/** sin(x) from its Taylor series, accurate to double precision for x from 0 to pi/2. Unlike
+ * `sin` it is constexpr, so the compiler can build the sine table below.
+ */
+constexpr double taylorSine(double x)
+{
+	double term = x;
+	double sum = x;
+	for (int n = 1; n < 16; n++) {
+		term *= -x * x / ((2 * n) * (2 * n + 1));
+		sum += term;
+	}
+	return sum;
+}
+
+/** sin(x) for x from 0 to pi/2 in SINE_TABLE_SIZE steps, plus a guard point. */
+struct Sine_Table
+{
+	float values[SINE_TABLE_SIZE + 1] {};
+
+	constexpr Sine_Table()
+	{
+		for (int i = 0; i <= SINE_TABLE_SIZE; i++) {
+			values[i] = taylorSine(M_PI / 2 * i / SINE_TABLE_SIZE);
+		}
+	}
+};
+
+// built at compile time, so a pedal that starts straight into a wah preset computes nothing
+static constexpr Sine_Table sine_table;
+
+/** Returns the sine table shared by every stage. */
+static const float *sineTable(void)
+{
+	return sine_table.values;
+}
+
+/** Copies a stage into a local, runs its `tick` over a block and stores the state back. */
+template <typename Stage>
+inline void runStage(Stage &stage, const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes)
+{
+	Stage local = stage;
+	for (jack_nframes_t i = 0; i < nframes; i++) {
+		out[i] = local.tick(in[i]);
+	}
+	stage = local;
+}
+
+/** Soft clipping overdrive, see @ref overdrive "Overdrive". */
+struct Overdrive
+{
+	float k;
+
+	Overdrive() { setDrive(1); }
+
+	/** @param drive Amount of overdrive from 0 to 1 */
+	void setDrive(double drive)
+	{
+		k = 2 * sin(((drive * 100 + 1) / 101) * 3.14159/2);
+	}
+
+	void setSampleRate(jack_nframes_t rate) {}
+
+	inline float tick(float x)
+	{
+		return (1 + k) * x / (1 + k * fabsf(x));
+	}
+
+	void process(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes)
+	{
+		simdKernels().overdrive(in, out, nframes, k);
+	}
+
+	void processChannels(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, int channels, jack_nframes_t nframes)
+	{
+		for (int c = 0; c < channels; c++) {
+			process(in[c], out[c], nframes);
+		}
+	}
+};
+
+/** Hard clipping distortion, see @ref distortion "Distortion". */
+struct Distortion
+{
+	float gain;
+
+	Distortion() { setDistortion(.8); }
+
+	/** @param dist Amount of distortion from 0 to 1 */
+	void setDistortion(double dist)
+	{
+		gain = 5 * dist;
+	}
+
+	void setSampleRate(jack_nframes_t rate) {}
+
+	inline float tick(float x)
+	{
+		float sample = gain * x;
+		sample = sample > DISTORTION_LIMIT ? DISTORTION_LIMIT : sample;
+		sample = sample < -DISTORTION_LIMIT ? -DISTORTION_LIMIT : sample;
+		return sample;
+	}
+
+	void process(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes)
+	{
+		simdKernels().distortion(in, out, nframes, gain, DISTORTION_LIMIT);
+	}
+
+	void processChannels(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, int channels, jack_nframes_t nframes)
+	{
+		for (int c = 0; c < channels; c++) {
+			process(in[c], out[c], nframes);
+		}
+	}
+};
+
+/** Short feedback echo, see @ref reverb "Reverb".
+ *
+ * Owns its echo buffer, so it can be moved but not copied.
+ */
+struct Reverb
+{
+	jack_default_audio_sample_t *buf; // REVERB_LENGTH samples for each channel, one after another
+	uint32_t counter;
+	uint32_t max_ind;
+	float decay;
+	int channels; // number of channels buf has room for
+
+	Reverb()
+	{
+		buf = NULL;
+		channels = 0;
+		counter = 0;
+		setChannels(1);
+		setSampleRate(DEFAULT_SAMPLE_RATE);
+		setDecay(.5);
+	}
+
+	~Reverb()
+	{
+		dspFree(buf);
+	}
+
+	Reverb(const Reverb &) = delete;
+	Reverb &operator=(const Reverb &) = delete;
+
+	Reverb(Reverb &&other)
+	{
+		buf = NULL;
+		channels = 0;
+		*this = std::move(other);
+	}
+
+	Reverb &operator=(Reverb &&other)
+	{
+		if (this == &other) return *this;
+		dspFree(buf);
+		buf = other.buf;
+		channels = other.channels;
+		counter = other.counter;
+		max_ind = other.max_ind;
+		decay = other.decay;
+		other.buf = NULL;
+		other.channels = 0;
+		return *this;
+	}
+
+	/** Makes room for an echo per channel. This allocates, so call it before starting audio. */
+	void setChannels(int count)
+	{
+		if (count == channels) return;
+		dspFree(buf);
+		buf = dspAlloc<jack_default_audio_sample_t>(count * REVERB_LENGTH);
+		channels = count;
+	}
+
+	void setSampleRate(jack_nframes_t rate)
+	{
+		if (rate > MAX_SAMPLE_RATE) rate = MAX_SAMPLE_RATE;
+		max_ind = (uint32_t)(rate * REVERB_SECONDS) - 1;
+		if (counter > max_ind) counter = 0;
+	}
+
+	/** @param value Fraction of the signal fed back on each repeat, from 0 to 1 */
+	void setDecay(double value)
+	{
+		decay = value;
+	}
+
+	inline float tick(float x)
+	{
+		buf[counter] = decay * buf[counter] + x;
+		float sample = buf[counter];
+		if (++counter > max_ind) counter = 0;
+		return sample;
+	}
+
+	void process(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes)
+	{
+		counter = runChannel(buf, counter, in, out, nframes);
+	}
+
+	/** Runs each channel through its own echo. `channels` must not exceed `setChannels`. */
+	void processChannels(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, int count, jack_nframes_t nframes)
+	{
+		uint32_t pos = counter;
+		for (int c = 0; c < count; c++) {
+			pos = runChannel(buf + c * REVERB_LENGTH, counter, in[c], out[c], nframes);
+		}
+		counter = pos;
+	}
+
+	/** Runs one channel's echo from `pos` and returns the position it ends at. */
+	inline uint32_t runChannel(jack_default_audio_sample_t *rv_buf, uint32_t pos, const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes)
+	{
+		jack_nframes_t i = 0;
+
+		// run in contiguous chunks up to the wrap point so the inner loop has no branch
+		while (i < nframes) {
+			jack_nframes_t run = max_ind + 1 - pos;
+			if (run > nframes - i) run = nframes - i;
+
+			for (jack_nframes_t j = 0; j < run; j++) {
+				rv_buf[pos + j] = decay * rv_buf[pos + j] + in[i + j];
+				out[i + j] = rv_buf[pos + j];
+			}
+
+			i += run;
+			pos += run;
+			if (pos > max_ind) pos = 0;
+		}
+		return pos;
+	}
+};
+
+/** Square wave volume modulation, see @ref tremolo "Tremolo". */
+struct Tremolo
+{
+	uint32_t counter;
+	uint32_t max_count; // samples between toggles, never 0
+	int state;
+	float off_volume;
+	double seconds;
+	jack_nframes_t sample_rate;
+
+	Tremolo()
+	{
+		counter = 0;
+		state = 1;
+		sample_rate = DEFAULT_SAMPLE_RATE;
+		setRate(.2);
+		setOffVolume(0);
+	}
+
+	/** @param value Time the volume stays on (and then off) in seconds */
+	void setRate(double value)
+	{
+		seconds = value;
+		max_count = sample_rate * seconds;
+		if (max_count == 0) max_count = UINT32_MAX;
+	}
+
+	void setSampleRate(jack_nframes_t rate)
+	{
+		sample_rate = rate;
+		setRate(seconds);
+	}
+
+	/** @param volume Volume while the tremolo is off, from 0 to 1 */
+	void setOffVolume(double volume)
+	{
+		off_volume = volume;
+	}
+
+	inline float tick(float x)
+	{
+		if (counter >= max_count) {
+			state = !state;
+			counter = 0;
+		}
+		counter++;
+		return state == 1 ? x : off_volume * x;
+	}
+
+	void process(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes)
+	{
+		processChannels(&in, &out, 1, nframes);
+	}
+
+	void processChannels(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, int channels, jack_nframes_t nframes)
+	{
+		uint32_t pos = counter;
+		int on = state;
+		jack_nframes_t i = 0;
+
+		// the gain only changes when the counter expires, so apply it in runs
+		while (i < nframes) {
+			if (pos >= max_count) {
+				on = !on;
+				pos = 0;
+			}
+
+			jack_nframes_t run = max_count - pos;
+			if (run > nframes - i) run = nframes - i;
+
+			const float gain = on == 1 ? 1.0f : off_volume;
+			for (int c = 0; c < channels; c++) {
+				const jack_default_audio_sample_t *src = in[c] + i;
+				jack_default_audio_sample_t *dst = out[c] + i;
+				for (jack_nframes_t j = 0; j < run; j++) {
+					dst[j] = gain * src[j];
+				}
+			}
+
+			i += run;
+			pos += run;
+		}
+		counter = pos;
+		state = on;
+	}
+};
+
+/** Swept state-variable band pass filter, see @ref wah "Wah". */
+struct Wah
+{
+	float yb[FX_MAX_CHANNELS]; // band pass output from the previous sample, per channel
+	float yl[FX_MAX_CHANNELS]; // low pass output from the previous sample, per channel
+	uint32_t phase; // position in the sweep, wraps from the end back to the start
+	uint32_t phase_step; // amount added to phase each sample
+	float sweep_start; // table position of the lowest centre frequency
+	float sweep_span; // table positions covered by one sweep
+	const float *sine;
+	double seconds;
+	jack_nframes_t sample_rate;
+
+	Wah()
+	{
+		memset(yb, 0, sizeof(yb));
+		memset(yl, 0, sizeof(yl));
+		phase = 0;
+		sine = sineTable();
+		seconds = 1.5;
+		setSampleRate(DEFAULT_SAMPLE_RATE);
+	}
+
+	/** @param value Time taken to sweep from the lowest to the highest frequency in seconds */
+	void setDuration(double value)
+	{
+		// one sweep is a full turn of the 32 bit phase accumulator
+		seconds = value;
+		double samples = seconds * sample_rate;
+		phase_step = samples >= 1 ? (uint32_t)(4294967296.0 / samples) : UINT32_MAX;
+	}
+
+	void setSampleRate(jack_nframes_t rate)
+	{
+		sample_rate = rate;
+
+		// F1 = 2sin(pi*fc/fs), and the table covers 0 to pi/2 in SINE_TABLE_SIZE steps.
+		// The sweep is capped below fs/2 so it never runs off the end of the table.
+		const float scale = 2.0f * SINE_TABLE_SIZE / rate;
+		float max_freq = WAH_MAX_FREQ < rate / 2 ? WAH_MAX_FREQ : rate / 2 - 1;
+		sweep_start = WAH_MIN_FREQ * scale;
+		sweep_span = (max_freq - WAH_MIN_FREQ) * scale;
+		setDuration(seconds);
+	}
+
+	/** Filter coefficient for the current position in the sweep. */
+	inline float coefficient(void) const
+	{
+		const float pos = sweep_start + sweep_span * (phase * (1.0f / 4294967296.0f));
+		const uint32_t ind = (uint32_t)pos;
+		return 2 * (sine[ind] + (pos - ind) * (sine[ind + 1] - sine[ind]));
+	}
+
+	inline float tick(float x)
+	{
+		const float F1 = coefficient();
+
+		const float yh = x - yl[0] - 0.1f * yb[0];
+		yb[0] = F1 * yh + yb[0];
+		yl[0] = F1 * yb[0] + yl[0];
+
+		phase += phase_step;
+		return yb[0];
+	}
+
+	void process(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes)
+	{
+		runStage(*this, in, out, nframes);
+	}
+
+	void processChannels(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, int channels, jack_nframes_t nframes)
+	{
+		if (channels == 1) {
+			process(in[0], out[0], nframes);
+			return;
+		}
+
+		// the sweep is shared, so F1 is worked out once per sample and then every channel's
+		// filter steps together, one channel per SIMD lane (unused lanes just filter silence)
+		Wah local = *this;
+		float x[FX_MAX_CHANNELS] = { 0 };
+		for (jack_nframes_t i = 0; i < nframes; i++) {
+			const float F1 = local.coefficient();
+			local.phase += local.phase_step;
+
+			for (int c = 0; c < channels; c++) {
+				x[c] = in[c][i];
+			}
+			for (int c = 0; c < FX_MAX_CHANNELS; c++) {
+				const float yh = x[c] - local.yl[c] - 0.1f * local.yb[c];
+				local.yb[c] = F1 * yh + local.yb[c];
+				local.yl[c] = F1 * local.yb[c] + local.yl[c];
+			}
+			for (int c = 0; c < channels; c++) {
+				out[c][i] = local.yb[c];
+			}
+		}
+		*this = local;
+	}
+};
+
+#endif
+
+/** @} */
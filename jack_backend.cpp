@@ -0,0 +1,308 @@
+/** @file
+ * @addtogroup backend Audio Backends
+ *
+ * @{
+ *
+ * @brief This file contains the JACK backend, which registers an input and an output port
+ * per channel and connects them to the physical capture and playback ports.
+ *
+ * A mono client keeps the original port names, `input` and `output`. With more channels
+ * the ports are numbered (`input_1`, `input_2`, ...). Each output goes to the physical
+ * playback port with the same number. Each input comes from the physical capture port
+ * with the same number, or from the last capture port if there are fewer, so a single
+ * guitar input can feed a stereo rig.
+ *
+ * When the processing adds latency of its own (see @ref pipeline "FX Pipeline"), a latency
+ * callback adds it to the range of every port, so JACK and other clients can line the
+ * pedal's output up with the rest of the session.
+ */
+#pragma once
+
+#ifndef JACK_BACKEND_CPP_
+#define JACK_BACKEND_CPP_
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <atomic>
+#include <jack/jack.h>
+
+#include "audio_backend.cpp"
+
+class Jack_Backend : public Audio_Backend
+{
+	public:
+		int open(const char *name);
+		int start(Audio_Process_Callback callback, void *arg);
+		void stop(void);
+		jack_nframes_t sampleRate(void);
+		jack_nframes_t bufferSize(void);
+		int realtimePriority(void);
+		void onSampleRate(Audio_Rate_Callback callback, void *arg);
+		void onBufferSize(Audio_Buffer_Size_Callback callback, void *arg);
+		void onXrun(Audio_Xrun_Callback callback, void *arg);
+		void setLatency(jack_nframes_t samples) { _latency_samples.store(samples, std::memory_order_relaxed); }
+		int channels(void) { return _channels; }
+
+		/** Set up a JACK backend.
+		 *
+		 * @param channels Number of input and output ports to register
+		 */
+		Jack_Backend(int channels = 1);
+		~Jack_Backend();
+
+	private:
+		int connectPorts(void);
+		static int jackProcess(jack_nframes_t nframes, void *arg);
+		static int jackSampleRate(jack_nframes_t rate, void *arg);
+		static int jackBufferSize(jack_nframes_t nframes, void *arg);
+		static int jackXrun(void *arg);
+		static void jackLatency(jack_latency_callback_mode_t mode, void *arg);
+		static void jackShutdown(void *arg);
+
+		jack_client_t *_client;
+		int _channels;
+		jack_port_t **_input_ports;
+		jack_port_t **_output_ports;
+		jack_default_audio_sample_t **_in; // port buffers for the current period
+		jack_default_audio_sample_t **_out;
+
+		Audio_Process_Callback _callback;
+		void *_callback_arg;
+		Audio_Rate_Callback _rate_callback;
+		void *_rate_callback_arg;
+		Audio_Buffer_Size_Callback _size_callback;
+		void *_size_callback_arg;
+		Audio_Xrun_Callback _xrun_callback;
+		void *_xrun_callback_arg;
+		std::atomic<jack_nframes_t> _latency_samples;
+};
+
+Jack_Backend::Jack_Backend(int channels)
+{
+	_client = NULL;
+	_channels = channels;
+	_input_ports = new jack_port_t *[channels]();
+	_output_ports = new jack_port_t *[channels]();
+	_in = new jack_default_audio_sample_t *[channels];
+	_out = new jack_default_audio_sample_t *[channels];
+	_callback = NULL;
+	_callback_arg = NULL;
+	_rate_callback = NULL;
+	_rate_callback_arg = NULL;
+	_size_callback = NULL;
+	_size_callback_arg = NULL;
+	_xrun_callback = NULL;
+	_xrun_callback_arg = NULL;
+	_latency_samples = 0;
+}
+
+Jack_Backend::~Jack_Backend()
+{
+	stop();
+	delete[] _input_ports;
+	delete[] _output_ports;
+	delete[] _in;
+	delete[] _out;
+}
+
+int Jack_Backend::open(const char *name)
+{
+	_client = jack_client_open(name != NULL ? name : "client", JackNullOption, NULL);
+	if (_client == NULL) {
+		printf("Could not open JACK client\n");
+		return -1;
+	}
+
+	jack_on_shutdown(_client, jackShutdown, this);
+
+	for (int c = 0; c < _channels; c++) {
+		char input_name[32], output_name[32];
+		if (_channels == 1) {
+			snprintf(input_name, sizeof(input_name), "input");
+			snprintf(output_name, sizeof(output_name), "output");
+		} else {
+			snprintf(input_name, sizeof(input_name), "input_%d", c + 1);
+			snprintf(output_name, sizeof(output_name), "output_%d", c + 1);
+		}
+
+		_input_ports[c] = jack_port_register(_client, input_name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
+		_output_ports[c] = jack_port_register(_client, output_name, JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+		if (_input_ports[c] == NULL || _output_ports[c] == NULL) {
+			printf("Could not register JACK ports\n");
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+int Jack_Backend::start(Audio_Process_Callback callback, void *arg)
+{
+	_callback = callback;
+	_callback_arg = arg;
+	jack_set_process_callback(_client, jackProcess, this);
+	if (_rate_callback != NULL) {
+		jack_set_sample_rate_callback(_client, jackSampleRate, this);
+	}
+	if (_size_callback != NULL) {
+		jack_set_buffer_size_callback(_client, jackBufferSize, this);
+	}
+	if (_xrun_callback != NULL) {
+		jack_set_xrun_callback(_client, jackXrun, this);
+	}
+	if (_latency_samples.load(std::memory_order_relaxed) > 0) {
+		jack_set_latency_callback(_client, jackLatency, this);
+	}
+
+	if (jack_activate(_client)) {
+		printf("Could not activate client\n");
+		return -1;
+	}
+
+	return connectPorts();
+}
+
+int Jack_Backend::connectPorts(void)
+{
+	const char **ports;
+	int count;
+
+	if ((ports = jack_get_ports(_client, NULL, NULL, JackPortIsOutput | JackPortIsPhysical)) == NULL) {
+		printf("Could not find input ports\n");
+		return -1;
+	}
+	for (count = 0; ports[count] != NULL; count++);
+
+	for (int c = 0; c < _channels; c++) {
+		const char *source = ports[c < count ? c : count - 1];
+		printf("Connecting %s to %s\n", source, jack_port_name(_input_ports[c]));
+
+		if (jack_connect(_client, source, jack_port_name(_input_ports[c]))) {
+			printf("Could not connect to input ports\n");
+			jack_free(ports);
+			return -1;
+		}
+	}
+	jack_free(ports);
+
+	if ((ports = jack_get_ports(_client, NULL, NULL, JackPortIsInput | JackPortIsPhysical)) == NULL) {
+		printf("Could not find output ports\n");
+		return -1;
+	}
+
+	for (int c = 0; c < _channels && ports[c] != NULL; c++) {
+		printf("Connecting %s to %s\n", jack_port_name(_output_ports[c]), ports[c]);
+
+		if (jack_connect(_client, jack_port_name(_output_ports[c]), ports[c])) {
+			printf("Could not connect to output ports\n");
+			jack_free(ports);
+			return -1;
+		}
+	}
+	jack_free(ports);
+
+	return 0;
+}
+
+void Jack_Backend::stop(void)
+{
+	if (_client != NULL) {
+		jack_client_close(_client);
+		_client = NULL;
+	}
+}
+
+jack_nframes_t Jack_Backend::sampleRate(void)
+{
+	return jack_get_sample_rate(_client);
+}
+
+jack_nframes_t Jack_Backend::bufferSize(void)
+{
+	return jack_get_buffer_size(_client);
+}
+
+int Jack_Backend::realtimePriority(void)
+{
+	const int priority = jack_client_real_time_priority(_client);
+	return priority > 0 ? priority : 0;
+}
+
+void Jack_Backend::onSampleRate(Audio_Rate_Callback callback, void *arg)
+{
+	_rate_callback = callback;
+	_rate_callback_arg = arg;
+}
+
+int Jack_Backend::jackSampleRate(jack_nframes_t rate, void *arg)
+{
+	Jack_Backend *backend = static_cast<Jack_Backend *>(arg);
+	backend->_rate_callback(rate, backend->_rate_callback_arg);
+	return 0;
+}
+
+void Jack_Backend::onBufferSize(Audio_Buffer_Size_Callback callback, void *arg)
+{
+	_size_callback = callback;
+	_size_callback_arg = arg;
+}
+
+int Jack_Backend::jackBufferSize(jack_nframes_t nframes, void *arg)
+{
+	Jack_Backend *backend = static_cast<Jack_Backend *>(arg);
+	backend->_size_callback(nframes, backend->_size_callback_arg);
+	return 0;
+}
+
+void Jack_Backend::onXrun(Audio_Xrun_Callback callback, void *arg)
+{
+	_xrun_callback = callback;
+	_xrun_callback_arg = arg;
+}
+
+int Jack_Backend::jackXrun(void *arg)
+{
+	Jack_Backend *backend = static_cast<Jack_Backend *>(arg);
+	backend->_xrun_callback(backend->_xrun_callback_arg);
+	return 0;
+}
+
+void Jack_Backend::jackLatency(jack_latency_callback_mode_t mode, void *arg)
+{
+	Jack_Backend *backend = static_cast<Jack_Backend *>(arg);
+	const jack_nframes_t extra = backend->_latency_samples.load(std::memory_order_relaxed);
+	jack_latency_range_t range;
+
+	// capture latency flows from our inputs to our outputs, playback latency the other way
+	for (int c = 0; c < backend->_channels; c++) {
+		jack_port_t *from = mode == JackCaptureLatency ? backend->_input_ports[c] : backend->_output_ports[c];
+		jack_port_t *to = mode == JackCaptureLatency ? backend->_output_ports[c] : backend->_input_ports[c];
+
+		jack_port_get_latency_range(from, mode, &range);
+		range.min += extra;
+		range.max += extra;
+		jack_port_set_latency_range(to, mode, &range);
+	}
+}
+
+int Jack_Backend::jackProcess(jack_nframes_t nframes, void *arg)
+{
+	Jack_Backend *backend = static_cast<Jack_Backend *>(arg);
+
+	for (int c = 0; c < backend->_channels; c++) {
+		backend->_in[c] = (jack_default_audio_sample_t *) jack_port_get_buffer(backend->_input_ports[c], nframes);
+		backend->_out[c] = (jack_default_audio_sample_t *) jack_port_get_buffer(backend->_output_ports[c], nframes);
+	}
+
+	return backend->_callback(backend->_in, backend->_out, nframes, backend->_callback_arg);
+}
+
+void Jack_Backend::jackShutdown(void *arg)
+{
+	printf("Jack Shutdown");
+	exit(1);
+}
+
+#endif
+
+/** @} */
@@ -0,0 +1,204 @@
+/** @file
+ * @addtogroup loadmeter Load Meter
+ *
+ * @{
+ *
+ * @brief This file contains a meter that shows how close each period's processing comes to
+ * its deadline. Details follow.
+ *
+ * The audio thread reads the CPU's cycle counter when `process` starts and again when it
+ * returns. The difference, as a fraction of the period's length, goes into a histogram
+ * with one bucket per tenth of a percent, so a report can give the median, the 99th percentile and
+ * the worst period. Anything at or past 100% missed its deadline, or only made it because
+ * the backend had slack to spare. The backend's xruns are counted alongside.
+ *
+ * Recording a period is one atomic add and, now and then, a compare-and-swap on the
+ * maximum, so it never blocks or makes a system call. A report is read from another thread
+ * and empties the histogram as it goes, so each report covers the time since the last one.
+ * Sending the pedal SIGUSR1 prints one; trying a preset between two reports shows whether
+ * it is safe at the current period size.
+ *
+ * The cycle counter is `rdtsc` on x86, whose rate is measured once at startup, and the
+ * generic timer on 64 bit ARM. Elsewhere it falls back to `CLOCK_MONOTONIC_RAW`.
+ */
+#pragma once
+
+#ifndef LOAD_METER_CPP_
+#define LOAD_METER_CPP_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <jack/jack.h>
+
+#define LOAD_BUCKETS 2000 ///< Histogram buckets, 0.1% of a period each; the last also counts anything slower
+#define LOAD_BUCKETS_PER_PERIOD 1000 ///< Buckets covering one whole period
+
+/** What the meter saw between two reports. Loads are fractions of a period. */
+struct Load_Report
+{
+	uint32_t periods;
+	uint32_t late; ///< Periods that took the whole period or longer
+	uint32_t xruns;
+	double p50;
+	double p99;
+	double max;
+};
+
+class Load_Meter
+{
+	public:
+		/** Measure how fast the cycle counter runs. Sleeps for a few milliseconds, so call
+		 * it once before audio starts.
+		 */
+		void calibrate(void);
+
+		/** Set the sampling rate that period lengths are worked out from. */
+		void setSampleRate(jack_nframes_t rate);
+
+		/** Read the cycle counter. */
+		static inline uint64_t now(void);
+
+		/** Record one period that started at `start`, a value from `now`. Only called on
+		 * the audio thread.
+		 */
+		void record(uint64_t start, jack_nframes_t nframes);
+
+		/** Count an xrun. Safe to call from any thread, including the audio thread. */
+		void xrun(void) { _xruns.fetch_add(1, std::memory_order_relaxed); }
+
+		/** Fill `report` with everything recorded since the last call, and start over.
+		 * Never called on the audio thread, and only from one thread at a time.
+		 */
+		void report(Load_Report &report);
+
+		/** Print a report on one line. */
+		void print(void);
+
+		Load_Meter();
+
+	private:
+		double _cycles_per_second;
+		double _cycles_per_frame;
+
+		std::atomic<uint32_t> _buckets[LOAD_BUCKETS];
+		std::atomic<uint32_t> _max; // worst period since the last report, in 1/10000ths of a period
+		std::atomic<uint32_t> _xruns;
+};
+
+Load_Meter load_meter; ///< Times the pedal's process callback
+
+Load_Meter::Load_Meter()
+{
+	_cycles_per_second = 1e9;
+	_cycles_per_frame = 0;
+	for (int i = 0; i < LOAD_BUCKETS; i++) {
+		_buckets[i].store(0, std::memory_order_relaxed);
+	}
+	_max.store(0, std::memory_order_relaxed);
+	_xruns.store(0, std::memory_order_relaxed);
+}
+
+inline uint64_t Load_Meter::now(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __builtin_ia32_rdtsc();
+#elif defined(__aarch64__)
+	uint64_t ticks;
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+	return ticks;
+#else
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC_RAW, &time);
+	return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+#endif
+}
+
+void Load_Meter::calibrate(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	const struct timespec wait = { 0, 20000000 }; // 20 ms
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC_RAW, &start);
+	const uint64_t first = now();
+	nanosleep(&wait, NULL);
+	const uint64_t last = now();
+	clock_gettime(CLOCK_MONOTONIC_RAW, &end);
+
+	const double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	if (elapsed > 0 && last > first) _cycles_per_second = (last - first) / elapsed;
+#elif defined(__aarch64__)
+	uint64_t frequency;
+	__asm__ __volatile__("mrs %0, cntfrq_el0" : "=r"(frequency));
+	if (frequency > 0) _cycles_per_second = frequency;
+#endif
+}
+
+void Load_Meter::setSampleRate(jack_nframes_t rate)
+{
+	_cycles_per_frame = rate > 0 ? _cycles_per_second / rate : 0;
+}
+
+void Load_Meter::record(uint64_t start, jack_nframes_t nframes)
+{
+	if (nframes == 0 || _cycles_per_frame <= 0) return;
+
+	const double load = (now() - start) / (_cycles_per_frame * nframes);
+
+	int bucket = load * LOAD_BUCKETS_PER_PERIOD;
+	if (bucket >= LOAD_BUCKETS) bucket = LOAD_BUCKETS - 1;
+	_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+
+	const uint32_t scaled = load < 4e5 ? load * 10000 : UINT32_MAX;
+	uint32_t max = _max.load(std::memory_order_relaxed);
+	while (scaled > max && !_max.compare_exchange_weak(max, scaled, std::memory_order_relaxed));
+}
+
+void Load_Meter::report(Load_Report &report)
+{
+	uint32_t counts[LOAD_BUCKETS];
+	report.periods = 0;
+	report.late = 0;
+	for (int i = 0; i < LOAD_BUCKETS; i++) {
+		counts[i] = _buckets[i].exchange(0, std::memory_order_relaxed);
+		report.periods += counts[i];
+		if (i >= LOAD_BUCKETS_PER_PERIOD) report.late += counts[i];
+	}
+	report.xruns = _xruns.exchange(0, std::memory_order_relaxed);
+	report.max = _max.exchange(0, std::memory_order_relaxed) / 10000.0;
+
+	// each percentile is the top of the first bucket that reaches it
+	const uint64_t p50 = ((uint64_t) report.periods * 50 + 99) / 100;
+	const uint64_t p99 = ((uint64_t) report.periods * 99 + 99) / 100;
+	report.p50 = report.p99 = 0;
+	uint64_t seen = 0;
+	for (int i = 0; i < LOAD_BUCKETS && seen < p99; i++) {
+		seen += counts[i];
+		if (report.p50 == 0 && seen >= p50) report.p50 = (i + 1) / (double) LOAD_BUCKETS_PER_PERIOD;
+		if (seen >= p99) report.p99 = (i + 1) / (double) LOAD_BUCKETS_PER_PERIOD;
+	}
+
+	// a bucket's top can overstate a sparse histogram; no percentile is worse than the worst period
+	if (report.p50 > report.max) report.p50 = report.max;
+	if (report.p99 > report.max) report.p99 = report.max;
+}
+
+void Load_Meter::print(void)
+{
+	Load_Report report;
+	this->report(report);
+
+	if (report.periods == 0) {
+		printf("DSP load: no periods since the last report, %u xruns\n", report.xruns);
+	} else {
+		printf("DSP load over %u periods: p50 %.1f%%, p99 %.1f%%, max %.1f%%, %u late, %u xruns\n",
+			report.periods, report.p50 * 100, report.p99 * 100, report.max * 100, report.late, report.xruns);
+	}
+	fflush(stdout);
+}
+
+#endif
+
+/** @} */
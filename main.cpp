@@ -12,119 +12,901 @@
 #include <errno.h>
 #include <termios.h>
 #include <pthread.h>
+#include <getopt.h>
+#include <time.h>
+#include <atomic>
 #include <jack/jack.h>
 #include "delay_buffer.cpp"
-#include "fx_processor.cpp"
+#include "fx_chain.cpp"
+#include "strip_rack.cpp"
+#include "fx_graph.cpp"
+#include "worker_pool.cpp"
+#include "wav_file.cpp"
+#include "command_queue.cpp"
+#include "rt_harden.cpp"
+#include "load_meter.cpp"
+#include "audio_backend.cpp"
+#include "jack_backend.cpp"
+#include "null_backend.cpp"
+#ifndef FX_NO_ALSA
+#include "alsa_backend.cpp"
+#endif
 
 
-#define SAMPLE_RATE 44100
 #define DURATION_SECONDS 1
+#define RETIRED_BUFFERS 4 ///< Old wet buffers the audio thread can hand back before they are freed
 
-Delay_Buffer buf;
-FX_Processor fx(NONE);
+/** Wet buffers for every strip's delay, allocated off the audio thread for a new period size. */
+struct Frame_Buffer
+{
+	jack_nframes_t frame_size;
+	int strips;
+	jack_default_audio_sample_t *samples[RACK_MAX_STRIPS];
+};
+
+/** Echo rings for every strip's delay, allocated off the audio thread for a new sampling
+ * rate or longest delay.
+ */
+struct Delay_Rings
+{
+	double max_seconds;
+	uint32_t ring_size;
+	int strips;
+	jack_default_audio_sample_t *samples[RACK_MAX_STRIPS];
+};
 
-jack_port_t *input_port;
-jack_port_t *output_port;
+Strip_Rack rack; ///< One pedal per musician; a single pedal is a rack of one strip
+Worker_Pool workers; ///< Threads that share out the rack's strips each period
+FX_Pipeline pipeline; ///< Spreads a single strip's chain over several cores, when asked for
+FX_Graph graph; ///< Runs a single strip's FX side by side instead of in a chain, when asked for
+int graph_nodes[FX_CHAIN_SLOTS]; ///< Graph node running each slot's FX, -1 for none
+pthread_t audio_thread; ///< The thread `process` runs on, once `audio_thread_seen` is set
+std::atomic<int> audio_thread_seen(0);
+Command_Queue commands; ///< Control changes from the UART thread to the audio thread
+std::atomic<jack_nframes_t> pending_sample_rate(0); ///< New rate from the backend, 0 if unchanged
+std::atomic<Frame_Buffer *> pending_frame_buffer(NULL); ///< Buffer for a new period size, NULL if unchanged
+std::atomic<Frame_Buffer *> retired_buffers[RETIRED_BUFFERS]; ///< Buffers the audio thread has swapped out
+std::atomic<Delay_Rings *> pending_delay_rings(NULL); ///< Rings for a new rate or longest delay, NULL if unchanged
+std::atomic<Delay_Rings *> retired_rings[RETIRED_BUFFERS]; ///< Rings the audio thread has swapped out
+double delay_max_seconds; ///< Longest delay the newest rings are sized for; never touched on the audio thread
+uint32_t delay_ring_size; ///< Samples per channel in the newest rings; never touched on the audio thread
 
 void *uartThread(void *arg);
 
-/** This function is called every time a frame of samples becomes available.
+/** Settings shared by the live JACK client and the offline renderer. */
+struct Pedal_Settings
+{
+	FX_types fx_types[FX_CHAIN_SLOTS]; ///< Initial FX in each slot of the chain
+	double delay_seconds;
+	double decay;
+	double level;
+	jack_nframes_t frame_size; ///< Block size for offline rendering and the ALSA and null backends
+	int channels; ///< Number of linked channels (ports) each strip processes
+	int strips; ///< Number of independent pedals in the rack
+	int workers; ///< Worker threads for the rack, 0 to run every strip on the audio thread
+	int pipeline; ///< Pipeline stages for a single strip's chain, 1 to run it in one piece
+	int graph; ///< 1 to run a single strip's FX side by side as an FX graph instead of a chain
+	double max_delay_seconds; ///< Longest delay the pedal can be set to, which sizes the delay memory
+	int delay_change; ///< How the echo follows a new delay length, from Delay_Change_types
+	Delay_Tap taps[DELAY_MAX_TAPS]; ///< Taps heard in multi-tap mode
+	int tap_count; ///< Number of taps, 0 for a single echo
+	double feedback_lowpass; ///< Lowpass cutoff in the delay's feedback in Hz, 0 for none
+	double feedback_highpass; ///< Highpass cutoff in the delay's feedback in Hz, 0 for none
+	double feedback_drive; ///< Saturation in the delay's feedback, 0 to 1
+	double wow_flutter; ///< Tape wow and flutter on the delay, 0 to 1
+	int harden; ///< 1 to lock and prefault memory and pin threads before audio starts
+	jack_nframes_t sample_rate; ///< Requested rate for the ALSA and null backends (JACK uses the server's)
+	int output_bits; ///< 16 or 32 bit output WAV
+	const char *backend; ///< jack, alsa or null
+	const char *device; ///< JACK client name or ALSA device, NULL for the default
+	int flat_out; ///< Run the null backend as fast as possible
+	unsigned int run_seconds; ///< How long to run live before exiting
+	const char *log_path; ///< File for DSP log messages, NULL for stdout
+};
+
+/** Sets a parameter for the graph node running a slot's FX, or for every node if `slot`
+ * is -1, as `FX_Chain::setParam` does for the chain.
+ */
+void setGraphParam(int slot, FX_param_types param, fxparam value)
+{
+	for (int i = 0; i < FX_CHAIN_SLOTS; i++) {
+		if ((slot == -1 || slot == i) && graph_nodes[i] >= 0) graph.setParam(graph_nodes[i], param, value);
+	}
+}
+
+/** Sets up every strip's FX chain and delay buffer with the pedal's default parameters.
  *
- * The process function passes the incoming frame of samples to the delay buffer. Once the
- * delay class's output buffer is ready, the process function copies the output buffer to
- * the output sound buffer.
+ * @param frame_size Number of samples in each frame
+ * @param sample_rate Sampling rate the audio actually runs at
+ */
+void setupPedal(const Pedal_Settings &settings, jack_nframes_t frame_size, jack_nframes_t sample_rate)
+{
+	rack.setStrips(settings.strips, settings.channels);
+
+	for (int s = 0; s < rack.strips(); s++) {
+		FX_Chain &fx = rack.strip(s).fx;
+		Delay_Buffer &buf = rack.strip(s).delay;
+
+		for (int i = 0; i < FX_CHAIN_SLOTS; i++) {
+			fx.setSlotFx(i, settings.fx_types[i]);
+		}
+		fx.setSampleRate(sample_rate);
+		fx.setParam(-1, TR_RATE, 0.1);
+		fx.setParam(-1, TR_OFF_VOLUME, .1);
+		fx.setParam(-1, DS_DIST, 1);
+		fx.setParam(-1, WAH_DURATION, 1);
+
+		buf = Delay_Buffer(settings.decay, settings.level, settings.delay_seconds, frame_size, sample_rate, settings.channels, settings.max_delay_seconds);
+		buf._fx_chain = &fx;
+		buf.setDelayChange(settings.delay_change);
+		buf.setTaps(settings.tap_count);
+		for (int t = 0; t < settings.tap_count; t++) {
+			buf.setTap(t, settings.taps[t].subdivision, settings.taps[t].level);
+			buf.setTapPan(t, settings.taps[t].pan);
+		}
+		buf.setFeedbackLowpass(settings.feedback_lowpass);
+		buf.setFeedbackHighpass(settings.feedback_highpass);
+		buf.setFeedbackDrive(settings.feedback_drive);
+		buf.setWowFlutter(settings.wow_flutter);
+	}
+	delay_max_seconds = rack.strip(0).delay.maxSeconds();
+	delay_ring_size = rack.strip(0).delay.ringSize();
+
+	if (settings.pipeline > 1) {
+		Channel_Strip &strip = rack.strip(0);
+		pipeline.setup(&strip.fx, settings.pipeline, settings.channels, settings.channels, frame_size);
+		pipeline.setWorkers(settings.workers > 0 ? &workers : NULL);
+		strip.delay.setPipeline(&pipeline);
+		printf("Pipelining the FX chain over %d stages of %u samples, adding %u samples of latency\n", settings.pipeline, pipeline.blockSize(), pipeline.latency());
+	}
+
+	for (int i = 0; i < FX_CHAIN_SLOTS; i++) {
+		graph_nodes[i] = -1;
+	}
+	if (settings.graph) {
+		// every FX hears the whole echo, and the branches are mixed back evenly
+		int branches = 0;
+		for (int i = 0; i < FX_CHAIN_SLOTS; i++) {
+			if (settings.fx_types[i] == NONE) continue;
+			graph_nodes[i] = graph.addFx(settings.fx_types[i]);
+			branches++;
+		}
+		for (int i = 0; i < FX_CHAIN_SLOTS; i++) {
+			if (graph_nodes[i] < 0) continue;
+			graph.connect(FX_GRAPH_INPUT, graph_nodes[i]);
+			graph.connect(graph_nodes[i], FX_GRAPH_OUTPUT, 1.0f / branches);
+		}
+		if (branches == 0) graph.connect(FX_GRAPH_INPUT, FX_GRAPH_OUTPUT);
+		graph.build(settings.channels, frame_size, sample_rate);
+
+		setGraphParam(-1, TR_RATE, 0.1);
+		setGraphParam(-1, TR_OFF_VOLUME, .1);
+		setGraphParam(-1, DS_DIST, 1);
+		setGraphParam(-1, WAH_DURATION, 1);
+
+		graph.setWorkers(settings.workers > 0 ? &workers : NULL);
+		rack.strip(0).delay.setEchoFx(FX_Graph::processEcho, &graph);
+		printf("Running %d FX side by side as a graph\n", branches);
+	}
+}
+
+/** Runs the FX chain over a WAV file as fast as the CPU allows.
  *
- * @param nframes The number of samples in the current frame.
+ * The input file is read into memory, pushed through the same rack of delay buffers and FX
+ * chains as the live client in blocks of `frame_size` samples, in place, and written to
+ * the output file. Only the processing loop is timed, so the reported rate is the
+ * throughput of the DSP alone.
+ *
+ * @return 0 on success, 1 if either file could not be read or written
  */
-int process (jack_nframes_t nframes, void *arg)
+int renderOffline(const char *in_path, const char *out_path, const Pedal_Settings &settings)
 {
-    jack_default_audio_sample_t *out = (jack_default_audio_sample_t *) jack_port_get_buffer(output_port, nframes);
-    jack_default_audio_sample_t *in = (jack_default_audio_sample_t *) jack_port_get_buffer(input_port, nframes);
+	Wav_File wav;
+	if (wav.read(in_path, settings.strips * settings.channels) != 0) return 1;
 
-	buf.newFrame(in);
-	
-	memcpy(out, buf._output_buffer, sizeof(jack_default_audio_sample_t) * nframes);
+	if (wav._sample_rate > MAX_SAMPLE_RATE) {
+		printf("%s is %u Hz, the highest supported rate is %d Hz\n", in_path, wav._sample_rate, MAX_SAMPLE_RATE);
+		return 1;
+	}
 
-	return 0;
+	setupPedal(settings, settings.frame_size, wav._sample_rate);
+	if (settings.harden) rtReportArena();
+	load_meter.calibrate();
+	load_meter.setSampleRate(wav._sample_rate);
+
+	jack_nframes_t frame_size = settings.frame_size;
+	size_t total = wav.frames();
+	jack_default_audio_sample_t *block[RACK_MAX_STRIPS * FX_MAX_CHANNELS];
+
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (size_t pos = 0; pos < total; pos += frame_size) {
+		size_t count = total - pos < frame_size ? total - pos : frame_size;
+		for (int c = 0; c < wav._channels; c++) {
+			block[c] = wav.channel(c) + pos;
+		}
+		const uint64_t block_start = Load_Meter::now();
+		rack.process(block, block, count);
+		load_meter.record(block_start, count);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	double audio_seconds = (double)total / wav._sample_rate;
+	printf("Rendered %zu samples (%.2f s of audio, %d channels) in %.3f s with %u sample blocks\n",
+		total, audio_seconds, wav._channels, elapsed, frame_size);
+	if (elapsed > 0) {
+		printf("%.0f samples/s, %.1fx real time\n", total / elapsed, audio_seconds / elapsed);
+	}
+	load_meter.print();
+
+	return wav.write(out_path, settings.output_bits) == 0 ? 0 : 1;
+}
+
+/** Bytes of DSP buffers `setupPedal` will allocate, so the arena can be sized to fit. */
+size_t pedalMemory(const Pedal_Settings &settings)
+{
+	// rings for the highest rate, twice over so a new ring fits while the old one is still playing
+	const double max_seconds = settings.delay_seconds > settings.max_delay_seconds ? settings.delay_seconds : settings.max_delay_seconds;
+	const size_t rings = 2 * Delay_Buffer::ringSamples(Delay_Buffer::ringSizeFor(max_seconds, MAX_SAMPLE_RATE), settings.channels);
+
+	// wet buffers for the first period, then for a period change of up to FX_PIPELINE_MAX_FRAMES
+	// while the old ones wait to be freed
+	const size_t wet = settings.channels * (settings.frame_size + 2 * FX_PIPELINE_MAX_FRAMES);
+
+	// each reverb starts with one channel and then grows to the strip's channel count
+	size_t strip = rings + wet + FX_CHAIN_SLOTS * (settings.channels + 1) * REVERB_LENGTH;
+	size_t samples = settings.strips * strip;
+	if (settings.pipeline > 1) samples += (2 * settings.pipeline + 1) * 2 * settings.channels * FX_PIPELINE_MAX_FRAMES;
+
+	// a graph node per FX, each with a block buffer and an FX of its own
+	if (settings.graph) samples += FX_CHAIN_SLOTS * (settings.channels * settings.frame_size + (settings.channels + 1) * REVERB_LENGTH);
+
+	// room for alignment, and for JACK handing out a bigger period than asked for
+	return samples * sizeof(jack_default_audio_sample_t) + 1024 * 1024;
+}
+
+/** Reserves the DSP arena, locks memory and moves this thread off the audio core. Threads
+ * created afterwards, like the log and UART threads, inherit the affinity.
+ */
+void hardenStartup(const Pedal_Settings &settings)
+{
+	printf("RT hardening:\n");
+	rt_arena.reserve(pedalMemory(settings), 1);
+	rtLockMemory();
+	rtPinAwayFromAudio(pthread_self(), "main");
+}
+
+/** Waits for the first period, then pins the audio thread and checks its priority. */
+void hardenAudioThread(void)
+{
+	for (int i = 0; i < 2000 && !audio_thread_seen.load(std::memory_order_acquire); i++) {
+		usleep(1000);
+	}
+	if (!audio_thread_seen.load(std::memory_order_acquire)) {
+		rtReport(0, "no period arrived within 2 s, so the audio thread could not be checked");
+		return;
+	}
+	rtCheckAudioThread(audio_thread);
+}
+
+/** Sleeps for `seconds`, printing a load report whenever SIGUSR1 arrives. SIGUSR1 has to
+ * be blocked in every thread already, so that it only ever ends up here.
+ */
+void waitForReports(unsigned int seconds)
+{
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+
+	struct timespec now, deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += seconds;
+
+	while (1) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		struct timespec left = { deadline.tv_sec - now.tv_sec, deadline.tv_nsec - now.tv_nsec };
+		if (left.tv_nsec < 0) {
+			left.tv_sec--;
+			left.tv_nsec += 1000000000;
+		}
+		if (left.tv_sec < 0) break;
+
+		if (sigtimedwait(&signals, NULL, &left) == SIGUSR1) load_meter.print();
+	}
+}
+
+/** Looks up a tap subdivision by its lowercase name, returning -1 if there is no such
+ * subdivision.
+ */
+int parseSubdivision(const char *name)
+{
+	const char *names[] = { "quarter", "dotted", "eighth", "triplet" };
+	for (int i = 0; i <= DELAY_TRIPLET; i++) {
+		if (strcmp(name, names[i]) == 0) return i;
+	}
+	return -1;
+}
+
+/** Looks up an FX type by its lowercase name, returning -1 if there is no such FX. */
+int parseFxName(const char *name)
+{
+	const char *names[] = { "none", "overdrive", "distortion", "reverb", "tremolo", "wah" };
+	for (int i = 0; i <= WAH; i++) {
+		if (strcmp(name, names[i]) == 0) return i;
+	}
+	return -1;
+}
+
+void usage(const char *program)
+{
+	printf("Usage: %s [options]\n"
+		"       %s --render input.wav output.wav [options]\n\n"
+		"  -r, --render         process input.wav into output.wav instead of running live\n"
+		"  -x, --fx NAME[,NAME] initial FX chain, in order: none, overdrive, distortion, reverb,\n"
+		"                       tremolo, wah (e.g. overdrive,wah,tremolo)\n"
+		"  -t, --delay SECONDS  delay time (default 1)\n"
+		"  -M, --max-delay SECONDS\n"
+		"                       longest delay the pedal can be set to, which sizes the delay\n"
+		"                       memory (default 2, or the delay time if that is longer)\n"
+		"  -k, --decay VALUE    delay decay, 0 to 1 (default 0.6)\n"
+		"  -T, --tempo-change glide|crossfade\n"
+		"                       how the echo follows a new delay time: bend the pitch like tape,\n"
+		"                       or fade between the old and new echo (default crossfade)\n"
+		"  -e, --taps SUB[:LEVEL[:PAN]][,...]\n"
+		"                       hear up to 8 taps instead of a single echo, each at a subdivision\n"
+		"                       of the delay: quarter, dotted (eighth), eighth or triplet, with a\n"
+		"                       level from 0 to 1 and a pan from -1 to 1 (e.g. dotted:.7:-1,quarter)\n"
+		"  -F, --feedback LOWPASS[:HIGHPASS[:DRIVE[:WOW]]]\n"
+		"                       voice the repeats like an analog or tape delay: lowpass and\n"
+		"                       highpass cutoffs in Hz (0 for none), saturation and wow and\n"
+		"                       flutter from 0 to 1 (e.g. 3000:120:.5:.3, default none)\n"
+		"  -l, --level VALUE    delay level, 0 to 1 (default 1)\n"
+		"  -b, --block FRAMES   block size when rendering, or period size for alsa/null (default 128)\n"
+		"  -c, --channels N     number of linked channels per strip, e.g. 2 for stereo (default 1)\n"
+		"  -m, --strips N       number of independent pedals, each with its own channels (default 1)\n"
+		"  -w, --workers N      worker threads sharing out the strips each period (default 0)\n"
+		"  -p, --pipeline N     split one strip's FX chain into N stages on the workers, adding\n"
+		"                       N - 1 periods of latency, of at most 2048 samples each (default 1)\n"
+		"  -G, --graph          run one strip's FX side by side on the workers instead of one\n"
+		"                       after another, each fed the whole echo and mixed evenly\n"
+		"  -o, --bits 16|32     output sample format when rendering (default 32 bit float)\n"
+		"  -a, --backend NAME   audio backend: jack, alsa or null (default jack)\n"
+		"  -d, --device NAME    JACK client name or ALSA device (default hw:0)\n"
+		"  -s, --rate HZ        sample rate for alsa/null (default 44100, JACK uses the server's)\n"
+		"  -f, --flat-out       run the null backend as fast as possible\n"
+		"  -n, --seconds N      exit after running live for N seconds\n"
+		"  -g, --log FILE       write DSP log messages to FILE instead of stdout\n"
+		"  -H, --harden         prefault and lock memory, pin threads and check RT priority\n\n"
+		"While running live, send SIGUSR1 (kill -USR1 PID) to print the DSP load since the last report.\n",
+		program, program);
+}
+
+/** Applies one control change from the command queue. Only called on the audio thread. */
+void applyCommand(const Command &command)
+{
+	if (command.strip < 0 || command.strip >= rack.strips()) return;
+
+	FX_Chain &fx = rack.strip(command.strip).fx;
+	Delay_Buffer &buf = rack.strip(command.strip).delay;
+
+	switch (command.type) {
+		case CMD_NEXT_FX:
+			fx.nextFx();
+			break;
+		case CMD_SET_FX:
+			fx.setSlotFx(command.slot, static_cast<FX_types>(command.arg));
+			break;
+		case CMD_SET_PARAM:
+			fx.setParam(command.slot, static_cast<FX_param_types>(command.arg), command.value);
+			if (command.strip == 0) setGraphParam(command.slot, static_cast<FX_param_types>(command.arg), command.value);
+			break;
+		case CMD_SET_BYPASS:
+			fx.setBypass(command.slot, command.arg);
+			break;
+		case CMD_MOVE_SLOT:
+			fx.moveSlot(command.slot, command.arg);
+			break;
+		case CMD_SELECT_SLOT:
+			fx.selectSlot(command.slot);
+			break;
+		case CMD_SET_DELAY_LENGTH:
+			buf.setDelayLength(command.value);
+			break;
+		case CMD_SET_DELAY_CHANGE:
+			buf.setDelayChange(command.arg);
+			break;
+		case CMD_SET_TAPS:
+			buf.setTaps(command.arg);
+			break;
+		case CMD_SET_TAP:
+			buf.setTap(command.slot, command.arg, command.value);
+			break;
+		case CMD_SET_TAP_PAN:
+			buf.setTapPan(command.slot, command.value);
+			break;
+		case CMD_SET_FEEDBACK_LOWPASS:
+			buf.setFeedbackLowpass(command.value);
+			break;
+		case CMD_SET_FEEDBACK_HIGHPASS:
+			buf.setFeedbackHighpass(command.value);
+			break;
+		case CMD_SET_FEEDBACK_DRIVE:
+			buf.setFeedbackDrive(command.value);
+			break;
+		case CMD_SET_WOW_FLUTTER:
+			buf.setWowFlutter(command.value);
+			break;
+		case CMD_SET_DECAY:
+			buf.setDecay(command.value);
+			break;
+		case CMD_SET_LEVEL:
+			buf.setLevel(command.value);
+			break;
+	}
+}
+
+/** Counts an xrun reported by the backend. May be called on the audio thread. */
+void xrunOccurred(void *arg)
+{
+	load_meter.xrun();
+}
+
+/** Frees a set of rings, whether or not the audio thread ever used them. */
+void freeDelayRings(Delay_Rings *rings)
+{
+	for (int s = 0; s < rings->strips; s++) {
+		dspFree(rings->samples[s]);
+	}
+	delete rings;
+}
+
+/** Frees the wet buffers and rings the audio thread has finished with. Never called on the
+ * audio thread.
+ */
+void freeRetiredBuffers(void)
+{
+	for (int i = 0; i < RETIRED_BUFFERS; i++) {
+		Frame_Buffer *frame = retired_buffers[i].exchange(NULL, std::memory_order_acquire);
+		if (frame != NULL) {
+			for (int s = 0; s < frame->strips; s++) {
+				dspFree(frame->samples[s]);
+			}
+			delete frame;
+		}
+
+		Delay_Rings *rings = retired_rings[i].exchange(NULL, std::memory_order_acquire);
+		if (rings != NULL) freeDelayRings(rings);
+	}
+}
+
+/** Prepares echo rings that hold `max_seconds` of delay at `rate` and hands them to the audio
+ * thread, unless the newest rings already have the right size. Never called on the audio
+ * thread.
+ */
+void resizeDelays(double max_seconds, jack_nframes_t rate)
+{
+	const uint32_t ring_size = Delay_Buffer::ringSizeFor(max_seconds, rate);
+	if (ring_size == delay_ring_size && max_seconds == delay_max_seconds) return;
+
+	freeRetiredBuffers();
+
+	Delay_Rings *rings = new Delay_Rings;
+	rings->max_seconds = max_seconds;
+	rings->ring_size = ring_size;
+	rings->strips = rack.strips();
+	for (int s = 0; s < rings->strips; s++) {
+		rings->samples[s] = dspAlloc<jack_default_audio_sample_t>(Delay_Buffer::ringSamples(ring_size, rack.channels()));
+	}
+	delay_max_seconds = max_seconds;
+	delay_ring_size = ring_size;
+
+	// replace any rings the audio thread has not picked up yet
+	Delay_Rings *unused = pending_delay_rings.exchange(rings, std::memory_order_acq_rel);
+	if (unused != NULL) freeDelayRings(unused);
+}
+
+/** Swaps in the rings prepared by `resizeDelays`, if there are any. Only called on the audio
+ * thread.
+ */
+void adoptDelayRings(void)
+{
+	Delay_Rings *rings = pending_delay_rings.exchange(NULL, std::memory_order_acquire);
+	if (rings == NULL) return;
+
+	// the same Delay_Rings carries the old rings back to be freed
+	for (int s = 0; s < rings->strips; s++) {
+		rings->samples[s] = rack.strip(s).delay.setRing(rings->samples[s], rings->ring_size, rings->max_seconds);
+	}
+
+	// resizeDelays empties these slots before preparing each set, so one is always free
+	for (int i = 0; i < RETIRED_BUFFERS; i++) {
+		Delay_Rings *empty = NULL;
+		if (retired_rings[i].compare_exchange_strong(empty, rings, std::memory_order_release)) break;
+	}
 }
 
-void jack_shutdown(void *arg)
+/** Notes a sampling rate change from the backend for the audio thread to pick up, with echo
+ * rings long enough for the longest delay at the new rate.
+ */
+void sampleRateChanged(jack_nframes_t rate, void *arg)
 {
-    printf("Jack Shutdown");
-    exit(1);
+	resizeDelays(delay_max_seconds, rate);
+	pending_sample_rate.store(rate, std::memory_order_release);
 }
 
-/** Prepares jack client and creates thread to read UART.
+/** Prepares wet buffers for a new period size and hands them to the audio thread.
  *
- * The main function sets up the JACK client, creates the FX processor object and the
- * delay buffer object, and creates a separate thread to constantly read the serial port
- * where UART info is being sent from the Tiva C.
+ * The backend calls this off the audio thread before the period size changes, so the
+ * allocation happens here and `process` only has to swap a pointer.
  */
-int main(int argc, const char * argv[])
+void bufferSizeChanged(jack_nframes_t nframes, void *arg)
 {
-	jack_client_t *client;
-	const char **ports;
+	freeRetiredBuffers();
 
-	client = jack_client_open("client", JackNullOption, NULL);
+	// the pipeline's blocks, and so its latency, follow the period size
+	static_cast<Audio_Backend *>(arg)->setLatency(pipeline.latencyFor(nframes));
 
-	fx = FX_Processor(NONE);
-	fx.setParam(TR_RATE, 0.1);
-	fx.setParam(TR_OFF_VOLUME, .1);
-	fx.setParam(DS_DIST, 1);
-	fx.setParam(WAH_DURATION, 1);
+	Frame_Buffer *frame = new Frame_Buffer;
+	frame->frame_size = nframes;
+	frame->strips = rack.strips();
+	for (int s = 0; s < frame->strips; s++) {
+		frame->samples[s] = dspAlloc<jack_default_audio_sample_t>(nframes * rack.channels());
+	}
 
-	buf = Delay_Buffer(.6, 1, 1, jack_get_buffer_size(client));
-	buf._fx_processor = &fx;
-	
+	// replace any buffers the audio thread has not picked up yet
+	Frame_Buffer *unused = pending_frame_buffer.exchange(frame, std::memory_order_acq_rel);
+	if (unused != NULL) {
+		for (int s = 0; s < unused->strips; s++) {
+			dspFree(unused->samples[s]);
+		}
+		delete unused;
+	}
+}
 
-	jack_set_process_callback(client, process, 0);
-	jack_on_shutdown(client, jack_shutdown, 0);
+/** Swaps in the buffers prepared by `bufferSizeChanged`, if there are any. Only called on the
+ * audio thread.
+ */
+void adoptFrameBuffer(void)
+{
+	Frame_Buffer *frame = pending_frame_buffer.exchange(NULL, std::memory_order_acquire);
+	if (frame == NULL) return;
 
-	input_port = jack_port_register(client, "input", JACK_DEFAULT_AUDIO_TYPE, JackPortIsInput, 0);
-	output_port = jack_port_register(client, "output", JACK_DEFAULT_AUDIO_TYPE, JackPortIsOutput, 0);
+	// the same Frame_Buffer carries the old buffers back to be freed
+	for (int s = 0; s < frame->strips; s++) {
+		frame->samples[s] = rack.strip(s).delay.setFrameSize(frame->frame_size, frame->samples[s]);
+	}
 
-	if (jack_activate(client)) {
-		printf("Could not activate client");
-		exit(1);
+	// bufferSizeChanged empties these slots before preparing each buffer, so one is always free
+	for (int i = 0; i < RETIRED_BUFFERS; i++) {
+		Frame_Buffer *empty = NULL;
+		if (retired_buffers[i].compare_exchange_strong(empty, frame, std::memory_order_release)) break;
 	}
-	//*
-	if ((ports = jack_get_ports(client, NULL, NULL, JackPortIsOutput | JackPortIsPhysical)) == NULL) {
-		printf("Could not find input ports\n");
-		exit(1);
+}
+
+/** Queues a control change for the audio thread. Only called from the UART thread. */
+void sendCommand(Command_types type, int strip, int slot, int arg, double value)
+{
+	Command command;
+	command.type = type;
+	command.strip = strip;
+	command.slot = slot;
+	command.arg = arg;
+	command.value = value;
+
+	if (!commands.push(command)) {
+		printf("Command queue full, dropping command %d\n", type);
 	}
+}
 
-	printf("Connecting %s to %s\n", ports[0], jack_port_name(input_port));
- 
+/** This function is called by the audio backend every time a frame of samples becomes
+ * available.
+ *
+ * Any control changes queued since the last frame are applied first, so they always take
+ * effect on a frame boundary, as do sampling rate and period size changes reported by the
+ * backend. The process function then passes the incoming frame of samples to the rack, where
+ * each strip's delay buffer writes its mixed frame straight into the output sound buffers.
+ * The whole call is timed by the @ref loadmeter "Load Meter".
+ *
+ * @param nframes The number of samples in the current frame.
+ */
+int process(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, jack_nframes_t nframes, void *arg)
+{
+	const uint64_t start = Load_Meter::now();
+
+	if (!audio_thread_seen.load(std::memory_order_relaxed)) {
+		audio_thread = pthread_self();
+		audio_thread_seen.store(1, std::memory_order_release);
+	}
+
+	Command command;
+	while (commands.pop(command)) {
+		applyCommand(command);
+	}
+
+	jack_nframes_t rate = pending_sample_rate.exchange(0, std::memory_order_acquire);
+	if (rate != 0) {
+		for (int s = 0; s < rack.strips(); s++) {
+			rack.strip(s).fx.setSampleRate(rate);
+			rack.strip(s).delay.setSampleRate(rate);
+		}
+		graph.setSampleRate(rate);
+		load_meter.setSampleRate(rate);
+		rt_log.log(LOG_SAMPLE_RATE, rate);
+	}
+
+	adoptFrameBuffer();
+	adoptDelayRings();
+
+	rack.process(in, out, nframes);
+
+	load_meter.record(start, nframes);
+	return 0;
+}
 
-	if (jack_connect(client, ports[0], jack_port_name(input_port))) {
-		printf("Could not connect to input ports\n");
+/** Starts the worker pool, if there is one, at the priority of the thread that waits on it.
+ *
+ * @param priority SCHED_FIFO priority of the audio thread, 0 if it is not real-time
+ */
+void startWorkers(const Pedal_Settings &settings, int priority)
+{
+	if (settings.workers == 0) return;
+
+	// workers start on the core after the audio thread's, leaving that one to audio and the system
+	if (workers.start(settings.workers, RT_AUDIO_CPU + 1, priority) != 0) exit(1);
+	rack.setWorkers(&workers);
+}
+
+/** Prepares the audio backend and creates thread to read UART.
+ *
+ * The main function opens the selected audio backend (JACK by default), creates the FX
+ * processor object and the delay buffer object, and creates a separate thread to
+ * constantly read the serial port where UART info is being sent from the Tiva C.
+ */
+int main(int argc, char * argv[])
+{
+	Pedal_Settings settings;
+	for (int i = 0; i < FX_CHAIN_SLOTS; i++) {
+		settings.fx_types[i] = NONE;
+	}
+	settings.delay_seconds = 1;
+	settings.decay = .6;
+	settings.level = 1;
+	settings.frame_size = 128;
+	settings.channels = 1;
+	settings.strips = 1;
+	settings.workers = 0;
+	settings.pipeline = 1;
+	settings.graph = 0;
+	settings.max_delay_seconds = DELAY_DEFAULT_MAX_SECONDS;
+	settings.delay_change = DELAY_CROSSFADE;
+	settings.tap_count = 0;
+	settings.feedback_lowpass = 0;
+	settings.feedback_highpass = 0;
+	settings.feedback_drive = 0;
+	settings.wow_flutter = 0;
+	settings.harden = 0;
+	settings.sample_rate = DEFAULT_SAMPLE_RATE;
+	settings.output_bits = 32;
+	settings.backend = "jack";
+	settings.device = NULL;
+	settings.flat_out = 0;
+	settings.run_seconds = 100000;
+	settings.log_path = NULL;
+	int render = 0;
+
+	static const struct option long_options[] = {
+		{ "render",	no_argument,		0, 'r' },
+		{ "fx",		required_argument,	0, 'x' },
+		{ "delay",	required_argument,	0, 't' },
+		{ "decay",	required_argument,	0, 'k' },
+		{ "max-delay",	required_argument,	0, 'M' },
+		{ "tempo-change",	required_argument,	0, 'T' },
+		{ "taps",	required_argument,	0, 'e' },
+		{ "feedback",	required_argument,	0, 'F' },
+		{ "level",	required_argument,	0, 'l' },
+		{ "block",	required_argument,	0, 'b' },
+		{ "channels",	required_argument,	0, 'c' },
+		{ "strips",	required_argument,	0, 'm' },
+		{ "workers",	required_argument,	0, 'w' },
+		{ "pipeline",	required_argument,	0, 'p' },
+		{ "graph",	no_argument,		0, 'G' },
+		{ "bits",	required_argument,	0, 'o' },
+		{ "backend",	required_argument,	0, 'a' },
+		{ "device",	required_argument,	0, 'd' },
+		{ "rate",	required_argument,	0, 's' },
+		{ "flat-out",	no_argument,		0, 'f' },
+		{ "seconds",	required_argument,	0, 'n' },
+		{ "log",	required_argument,	0, 'g' },
+		{ "harden",	no_argument,		0, 'H' },
+		{ "help",	no_argument,		0, 'h' },
+		{ 0, 0, 0, 0 }
+	};
+
+	int opt;
+	while ((opt = getopt_long(argc, argv, "rx:t:M:k:T:e:F:l:b:c:m:w:p:Go:a:d:s:fn:g:Hh", long_options, NULL)) != -1) {
+		switch (opt) {
+			case 'r': render = 1; break;
+			case 'x': {
+				char *name = strtok(optarg, ",");
+				for (int i = 0; name != NULL; i++, name = strtok(NULL, ",")) {
+					int type = parseFxName(name);
+					if (type < 0 || i >= FX_CHAIN_SLOTS) {
+						printf("Unknown FX or too many FX: %s\n", name);
+						exit(1);
+					}
+					settings.fx_types[i] = static_cast<FX_types>(type);
+				}
+				break;
+			}
+			case 't': settings.delay_seconds = atof(optarg); break;
+			case 'M': settings.max_delay_seconds = atof(optarg); break;
+			case 'k': settings.decay = atof(optarg); break;
+			case 'T':
+				if (strcmp(optarg, "glide") == 0) settings.delay_change = DELAY_GLIDE;
+				else if (strcmp(optarg, "crossfade") == 0) settings.delay_change = DELAY_CROSSFADE;
+				else {
+					printf("Unknown tempo change: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'e': {
+				char *tap = strtok(optarg, ",");
+				for (settings.tap_count = 0; tap != NULL; settings.tap_count++, tap = strtok(NULL, ",")) {
+					char name[16];
+					Delay_Tap setting = { DELAY_QUARTER, 1, 0 };
+					if (settings.tap_count >= DELAY_MAX_TAPS || sscanf(tap, "%15[a-z]:%lf:%lf", name, &setting.level, &setting.pan) < 1
+						|| (setting.subdivision = parseSubdivision(name)) < 0) {
+						printf("Unknown tap or too many taps: %s\n", tap);
+						exit(1);
+					}
+					settings.taps[settings.tap_count] = setting;
+				}
+				break;
+			}
+			case 'F':
+				if (sscanf(optarg, "%lf:%lf:%lf:%lf", &settings.feedback_lowpass, &settings.feedback_highpass,
+						&settings.feedback_drive, &settings.wow_flutter) < 1) {
+					printf("Unknown feedback voicing: %s\n", optarg);
+					exit(1);
+				}
+				break;
+			case 'l': settings.level = atof(optarg); break;
+			case 'b': settings.frame_size = atoi(optarg); break;
+			case 'c': settings.channels = atoi(optarg); break;
+			case 'm': settings.strips = atoi(optarg); break;
+			case 'w': settings.workers = atoi(optarg); break;
+			case 'p': settings.pipeline = atoi(optarg); break;
+			case 'G': settings.graph = 1; break;
+			case 'o': settings.output_bits = atoi(optarg) == 16 ? 16 : 32; break;
+			case 'a': settings.backend = optarg; break;
+			case 'd': settings.device = optarg; break;
+			case 's': settings.sample_rate = atoi(optarg); break;
+			case 'f': settings.flat_out = 1; break;
+			case 'n': settings.run_seconds = atoi(optarg); break;
+			case 'g': settings.log_path = optarg; break;
+			case 'H': settings.harden = 1; break;
+			default:
+				usage(argv[0]);
+				exit(opt == 'h' ? 0 : 1);
+		}
+	}
+
+	if (settings.delay_seconds > DELAY_MAX_SECONDS || settings.max_delay_seconds > DELAY_MAX_SECONDS) {
+		printf("Delays can be at most %d seconds\n", DELAY_MAX_SECONDS);
+		exit(1);
+	}
+	if (settings.channels < 1 || settings.channels > FX_MAX_CHANNELS) {
+		printf("Channels must be from 1 to %d\n", FX_MAX_CHANNELS);
 		exit(1);
 	}
-	//*/
-	//*
-	if ((ports = jack_get_ports(client, NULL, NULL, JackPortIsInput | JackPortIsPhysical)) == NULL) {
-		printf("Could not find output ports\n");
+	if (settings.strips < 1 || settings.strips > RACK_MAX_STRIPS) {
+		printf("Strips must be from 1 to %d\n", RACK_MAX_STRIPS);
 		exit(1);
 	}
+	// a worker sharing the audio core would leave the audio thread spinning at the barrier for it
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	const int spare_cpus = cpus > RT_AUDIO_CPU + 1 ? cpus - (RT_AUDIO_CPU + 1) : 0;
+	const int max_workers = spare_cpus < WORKER_MAX_THREADS ? spare_cpus : WORKER_MAX_THREADS;
+	if (settings.workers < 0 || settings.workers > max_workers) {
+		printf("Workers must be from 0 to %d, one per core besides the audio thread's\n", max_workers);
+		exit(1);
+	}
+	if (settings.pipeline < 1 || settings.pipeline > FX_PIPELINE_MAX_STAGES) {
+		printf("Pipeline stages must be from 1 to %d\n", FX_PIPELINE_MAX_STAGES);
+		exit(1);
+	}
+	if (settings.pipeline > 1 && settings.strips > 1) {
+		printf("Pipelining needs a single strip, the workers already share out several\n");
+		exit(1);
+	}
+	if (settings.graph && settings.strips > 1) {
+		printf("An FX graph needs a single strip, the workers already share out several\n");
+		exit(1);
+	}
+	if (settings.graph && settings.pipeline > 1) {
+		printf("The FX can either be pipelined or run as a graph, not both\n");
+		exit(1);
+	}
+	const int ports = settings.strips * settings.channels;
 
+	// every thread started from here on inherits this, so only waitForReports takes SIGUSR1
+	sigset_t report_signal;
+	sigemptyset(&report_signal);
+	sigaddset(&report_signal, SIGUSR1);
+	pthread_sigmask(SIG_BLOCK, &report_signal, NULL);
 
+	if (settings.harden) hardenStartup(settings);
 
-	printf("Connecting %s to %s\n", jack_port_name(output_port), ports[0]);
+	FILE *log_file = stdout;
+	if (settings.log_path != NULL && (log_file = fopen(settings.log_path, "a")) == NULL) {
+		perror(settings.log_path);
+		exit(1);
+	}
+	rt_log.start(log_file);
 
-	if (jack_connect(client, jack_port_name(output_port), ports[0])) {
-		printf("Could not connect to output ports\n");
+	if (render) {
+		if (argc - optind != 2 || settings.frame_size == 0) {
+			usage(argv[0]);
+			exit(1);
+		}
+		startWorkers(settings, 0);
+		int result = renderOffline(argv[optind], argv[optind + 1], settings);
+		workers.stop();
+		rt_log.stop();
+		return result;
+	}
+
+	Audio_Backend *backend;
+	if (strcmp(settings.backend, "jack") == 0) {
+		backend = new Jack_Backend(ports);
+	} else if (strcmp(settings.backend, "null") == 0) {
+		backend = new Null_Backend(settings.sample_rate, settings.frame_size, settings.flat_out, ports);
+#ifndef FX_NO_ALSA
+	} else if (strcmp(settings.backend, "alsa") == 0) {
+		backend = new Alsa_Backend(settings.sample_rate, settings.frame_size, ports);
+#endif
+	} else {
+		printf("Unknown backend: %s\n", settings.backend);
+		exit(1);
+	}
+
+	if (backend->open(settings.device)) {
+		exit(1);
+	}
+	startWorkers(settings, backend->realtimePriority());
+
+	if (backend->sampleRate() > MAX_SAMPLE_RATE) {
+		printf("Audio is running at %u Hz, the highest supported rate is %d Hz\n", backend->sampleRate(), MAX_SAMPLE_RATE);
 		exit(1);
 	}
-	//*/
+	setupPedal(settings, backend->bufferSize(), backend->sampleRate());
+	if (settings.harden) rtReportArena();
+	load_meter.calibrate();
+	load_meter.setSampleRate(backend->sampleRate());
+	backend->onSampleRate(sampleRateChanged, 0);
+	backend->onBufferSize(bufferSizeChanged, backend);
+	backend->onXrun(xrunOccurred, 0);
+	backend->setLatency(pipeline.latency());
 
-	free(ports);
+	if (backend->start(process, 0)) {
+		exit(1);
+	}
+	if (settings.harden) hardenAudioThread();
 
 	pthread_t pth;
 	pthread_create(&pth, NULL, uartThread, 0);
 	
-	sleep(100000);
-	
-	jack_client_close(client);
+	waitForReports(settings.run_seconds);
+
+	backend->stop();
+	load_meter.print();
+	delete backend;
+	workers.stop();
+	freeRetiredBuffers();
+	rt_log.stop();
 
 	return 0;
 }
@@ -134,14 +916,17 @@ int main(int argc, const char * argv[])
  * This function opens the ttyAMA0 device, which is the serial port where UART is
  * connected, and reads it in a while loop on a separate thread from the JACK client. The
  * Tiva C can send messages to cycle through the FX or to change the tempo of the delay.
+ * Those changes are queued for the audio thread rather than applied here, so this thread
+ * never touches the delay buffer or FX processor while they are running.
  */
 void *uartThread(void *arg)
 {
-     fd = open("/dev/ttyAMA0", O_RDONLY | O_NOCTTY);
+     int fd = open("/dev/ttyAMA0", O_RDONLY | O_NOCTTY);
      if (fd == -1)
      {
-        perror("open_port: Unable to open /dev/ttyO1\n");
-        exit(1);
+        // keep processing audio without the controller (e.g. on a box with no Tiva C)
+        perror("open_port: Unable to open /dev/ttyAMA0");
+        return NULL;
      }
 	struct termios options;
 	tcgetattr(fd, &options);
@@ -160,7 +945,7 @@ void *uartThread(void *arg)
 		} else if (n > 0) {
 			if (uart_buffer[0] == 'a') {
 				// cycle through fx
-				fx.nextFx();
+				sendCommand(CMD_NEXT_FX, 0, 0, 0, 0);
 			} else {
 				double tempo = 0;
 				for (int i = 0; i < strlen(uart_buffer) - 2; i++) {
@@ -171,7 +956,7 @@ void *uartThread(void *arg)
 				
 				tempo = tempo / 1000;
 				printf("Tempo: %f", tempo);
-				buf.setDelayLength(tempo);
+				sendCommand(CMD_SET_DELAY_LENGTH, 0, 0, 0, tempo);
 			}
 		}
 	}
@@ -0,0 +1,206 @@
+/** @file
+ * @addtogroup backend Audio Backends
+ *
+ * @{
+ *
+ * @brief This file contains the null backend, which calls the process callback without
+ * any audio hardware. Details follow.
+ *
+ * The input is a quiet 440 Hz tone so the FX have something to chew on, and the output is
+ * discarded. In timed mode the thread sleeps until each period's deadline on the monotonic
+ * clock, so it behaves like a sound card running at the configured rate. In flat out mode
+ * it calls the callback back to back, which is useful for benchmarks. Either way it
+ * reports how many periods ran and how many missed their deadline when it is stopped.
+ */
+#pragma once
+
+#ifndef NULL_BACKEND_CPP_
+#define NULL_BACKEND_CPP_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <cmath>
+#include <pthread.h>
+#include <time.h>
+#include <atomic>
+#include <jack/jack.h>
+
+#include "audio_backend.cpp"
+
+class Null_Backend : public Audio_Backend
+{
+	public:
+		int open(const char *name);
+		int start(Audio_Process_Callback callback, void *arg);
+		void stop(void);
+		jack_nframes_t sampleRate(void);
+		jack_nframes_t bufferSize(void);
+		int channels(void) { return _channels; }
+
+		/** Set up a null backend.
+		 *
+		 * @param sample_rate The rate the periods are paced at
+		 * @param buffer_size Number of samples in each period
+		 * @param flat_out If 1, run periods back to back instead of in real time
+		 * @param channels Number of channels, each fed the same test tone
+		 */
+		Null_Backend(jack_nframes_t sample_rate, jack_nframes_t buffer_size, int flat_out, int channels = 1);
+		~Null_Backend();
+
+	private:
+		static void *audioThread(void *arg);
+
+		jack_nframes_t _sample_rate;
+		jack_nframes_t _buffer_size;
+		int _flat_out;
+
+		int _channels;
+		jack_default_audio_sample_t *_in; // _buffer_size samples per channel, one channel after another
+		jack_default_audio_sample_t *_out;
+		jack_default_audio_sample_t **_in_channels; // start of each channel in _in
+		jack_default_audio_sample_t **_out_channels;
+
+		pthread_t _thread;
+		std::atomic<int> _running;
+		uint64_t _periods;
+		uint64_t _late_periods;
+		struct timespec _start_time;
+
+		Audio_Process_Callback _callback;
+		void *_callback_arg;
+};
+
+Null_Backend::Null_Backend(jack_nframes_t sample_rate, jack_nframes_t buffer_size, int flat_out, int channels)
+{
+	_sample_rate = sample_rate;
+	_buffer_size = buffer_size;
+	_flat_out = flat_out;
+	_channels = channels;
+	_in = NULL;
+	_out = NULL;
+	_in_channels = new jack_default_audio_sample_t *[channels];
+	_out_channels = new jack_default_audio_sample_t *[channels];
+	_running = 0;
+	_periods = 0;
+	_late_periods = 0;
+	_callback = NULL;
+	_callback_arg = NULL;
+}
+
+Null_Backend::~Null_Backend()
+{
+	stop();
+	delete[] _in;
+	delete[] _out;
+	delete[] _in_channels;
+	delete[] _out_channels;
+}
+
+int Null_Backend::open(const char *name)
+{
+	if (_sample_rate == 0 || _buffer_size == 0) {
+		printf("Null backend needs a sample rate and period size\n");
+		return -1;
+	}
+
+	_in = new jack_default_audio_sample_t[_channels * _buffer_size]();
+	_out = new jack_default_audio_sample_t[_channels * _buffer_size]();
+	for (int c = 0; c < _channels; c++) {
+		_in_channels[c] = _in + c * _buffer_size;
+		_out_channels[c] = _out + c * _buffer_size;
+	}
+	return 0;
+}
+
+int Null_Backend::start(Audio_Process_Callback callback, void *arg)
+{
+	_callback = callback;
+	_callback_arg = arg;
+	_running = 1;
+
+	clock_gettime(CLOCK_MONOTONIC, &_start_time);
+	if (pthread_create(&_thread, NULL, audioThread, this) != 0) {
+		printf("Could not start null backend thread\n");
+		_running = 0;
+		return -1;
+	}
+
+	printf("Null backend running at %u Hz, %u sample periods, %d channels%s\n", _sample_rate, _buffer_size,
+		_channels, _flat_out ? ", flat out" : "");
+	return 0;
+}
+
+void Null_Backend::stop(void)
+{
+	if (!_running) return;
+
+	_running = 0;
+	pthread_join(_thread, NULL);
+
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double elapsed = (now.tv_sec - _start_time.tv_sec) + (now.tv_nsec - _start_time.tv_nsec) / 1e9;
+	double audio_seconds = (double)_periods * _buffer_size / _sample_rate;
+
+	printf("Null backend ran %llu periods (%.2f s of audio) in %.2f s, %llu late\n",
+		(unsigned long long)_periods, audio_seconds, elapsed, (unsigned long long)_late_periods);
+	if (elapsed > 0) {
+		printf("%.1fx real time\n", audio_seconds / elapsed);
+	}
+}
+
+jack_nframes_t Null_Backend::sampleRate(void)
+{
+	return _sample_rate;
+}
+
+jack_nframes_t Null_Backend::bufferSize(void)
+{
+	return _buffer_size;
+}
+
+void *Null_Backend::audioThread(void *arg)
+{
+	Null_Backend *backend = static_cast<Null_Backend *>(arg);
+
+	const long period_ns = (long)(1e9 * backend->_buffer_size / backend->_sample_rate);
+	const float phase_step = 2 * M_PI * 440 / backend->_sample_rate;
+	float phase = 0;
+
+	struct timespec deadline = backend->_start_time;
+
+	while (backend->_running) {
+		for (jack_nframes_t i = 0; i < backend->_buffer_size; i++) {
+			for (int c = 0; c < backend->_channels; c++) {
+				backend->_in_channels[c][i] = 0.1f * sinf(phase);
+			}
+			phase += phase_step;
+			if (phase > 2 * M_PI) phase -= 2 * M_PI;
+		}
+
+		backend->_callback(backend->_in_channels, backend->_out_channels, backend->_buffer_size, backend->_callback_arg);
+		backend->_periods++;
+
+		if (backend->_flat_out) continue;
+
+		deadline.tv_nsec += period_ns;
+		while (deadline.tv_nsec >= 1000000000) {
+			deadline.tv_nsec -= 1000000000;
+			deadline.tv_sec++;
+		}
+
+		struct timespec now;
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec > deadline.tv_sec || (now.tv_sec == deadline.tv_sec && now.tv_nsec > deadline.tv_nsec)) {
+			backend->_late_periods++;
+		} else {
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &deadline, NULL);
+		}
+	}
+
+	return NULL;
+}
+
+#endif
+
+/** @} */
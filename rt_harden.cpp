@@ -0,0 +1,318 @@
+/** @file
+ * @addtogroup harden RT Hardening
+ *
+ * @{
+ *
+ * @brief This file contains the steps that make the pedal safe to run at real-time
+ * priority, and the memory arena the DSP buffers come from. Details follow.
+ *
+ * Memory that has been allocated but never touched is not really there yet. The first
+ * write to each page traps into the kernel to find a physical page for it, and a page that
+ * has not been used for a while can be swapped out. When that happens inside `process`, the
+ * period is late. `--harden` guards against it:
+ *
+ * - Every DSP buffer (echoes, reverb tails, pipeline and graph buffers) is carved from one
+ *   `Rt_Arena`, reserved up front with huge pages if the system has any, and written once
+ *   so that every page is in RAM before audio starts. A buffer freed when a chain is
+ *   rebuilt goes back to the arena and is handed out again for the next buffer of the
+ *   same size, so rebuilding presets over a long uptime never runs the arena dry.
+ * - `mlockall` keeps the whole process, including anything allocated later, in RAM.
+ * - The main, UART and log threads are pinned away from the audio core, so they never
+ *   compete with the audio thread for it.
+ * - Once audio is running, the audio thread is pinned to its core and its scheduling
+ *   policy is checked. A JACK server started without `-R`, or a user without an rtprio
+ *   limit, silently gives an ordinary thread, and this makes that visible.
+ *
+ * Every step prints one line saying what it did or why it could not. The pedal still runs
+ * if a step fails, just without that protection.
+ */
+#pragma once
+
+#ifndef RT_HARDEN_CPP_
+#define RT_HARDEN_CPP_
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define RT_AUDIO_CPU 0 ///< Core the audio thread is pinned to; workers start on the next one
+#define RT_HUGE_PAGE_SIZE (2 * 1024 * 1024) ///< Huge page size the arena is rounded up to
+#define RT_ARENA_ALIGN 64 ///< Alignment of every block carved from the arena, and the size of its header
+
+/** Prints one line of the hardening report. */
+static void rtReport(int ok, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	printf("RT %s ", ok ? "[ ok ]" : "[warn]");
+	vprintf(format, args);
+	printf("\n");
+	va_end(args);
+}
+
+class Rt_Arena
+{
+	public:
+		/** Map and prefault `bytes` of memory for `alloc` to carve up. Allocates, so call
+		 * it before any DSP objects are created.
+		 *
+		 * @param bytes Size of the arena
+		 * @param hugepages 1 to try huge pages first, falling back to ordinary pages
+		 *
+		 * @return 0 on success, -1 if no memory could be mapped
+		 */
+		int reserve(size_t bytes, int hugepages);
+
+		/** Carve a zeroed block from the arena, reusing a released block of the same size
+		 * if there is one. Never call it on the audio thread.
+		 *
+		 * @return The block, or NULL if no arena is reserved or there is not enough room
+		 */
+		void *alloc(size_t bytes);
+
+		/** Give a block from `alloc` back for reuse. */
+		void release(void *block);
+
+		/** Returns 1 if `p` points into the arena. */
+		int contains(const void *p) const { return p >= _base && p < _base + _size; }
+
+		size_t used(void) const { return _used; }
+		size_t size(void) const { return _size; }
+
+		/** Bytes that did not fit and came from the heap instead. */
+		size_t overflow(void) const { return _overflow; }
+		void addOverflow(size_t bytes) { _overflow += bytes; }
+
+		Rt_Arena();
+		~Rt_Arena();
+
+	private:
+		// sits in the RT_ARENA_ALIGN bytes just before each block
+		struct Block_Header
+		{
+			size_t bytes;
+			Block_Header *next; // next released block, while this one is released
+		};
+
+		char *_base;
+		size_t _size;
+		size_t _used;
+		size_t _overflow;
+		Block_Header *_released;
+		pthread_mutex_t _lock; // chains can be rebuilt from more than one non-audio thread
+};
+
+Rt_Arena::Rt_Arena()
+{
+	_base = NULL;
+	_size = 0;
+	_used = 0;
+	_overflow = 0;
+	_released = NULL;
+	pthread_mutex_init(&_lock, NULL);
+}
+
+Rt_Arena::~Rt_Arena()
+{
+	if (_base != NULL) munmap(_base, _size);
+	pthread_mutex_destroy(&_lock);
+}
+
+int Rt_Arena::reserve(size_t bytes, int hugepages)
+{
+	bytes = (bytes + RT_HUGE_PAGE_SIZE - 1) / RT_HUGE_PAGE_SIZE * RT_HUGE_PAGE_SIZE;
+
+	void *base = MAP_FAILED;
+	const char *kind = "ordinary pages";
+#ifdef MAP_HUGETLB
+	if (hugepages) {
+		base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		kind = "huge pages";
+	}
+#endif
+	if (base == MAP_FAILED) {
+		base = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		kind = "ordinary pages";
+		if (base == MAP_FAILED) {
+			rtReport(0, "could not map a %zu KB arena: %s", bytes / 1024, strerror(errno));
+			return -1;
+		}
+#ifdef MADV_HUGEPAGE
+		// transparent huge pages still cut TLB misses when there is no hugetlbfs pool
+		if (hugepages && madvise(base, bytes, MADV_HUGEPAGE) == 0) kind = "transparent huge pages";
+#endif
+	}
+
+	// write every page so the kernel backs it now rather than inside `process`
+	const long page = sysconf(_SC_PAGESIZE) > 0 ? sysconf(_SC_PAGESIZE) : 4096;
+	for (size_t offset = 0; offset < bytes; offset += page) {
+		static_cast<volatile char *>(base)[offset] = 0;
+	}
+
+	_base = static_cast<char *>(base);
+	_size = bytes;
+	_used = 0;
+	rtReport(1, "reserved and prefaulted a %zu KB DSP arena on %s", bytes / 1024, kind);
+	return 0;
+}
+
+void *Rt_Arena::alloc(size_t bytes)
+{
+	if (_base == NULL) return NULL;
+
+	pthread_mutex_lock(&_lock);
+
+	// DSP buffers come in a handful of sizes, so an exact match is usually waiting
+	for (Block_Header **link = &_released; *link != NULL; link = &(*link)->next) {
+		Block_Header *header = *link;
+		if (header->bytes != bytes) continue;
+
+		*link = header->next;
+		pthread_mutex_unlock(&_lock);
+
+		char *block = reinterpret_cast<char *>(header) + RT_ARENA_ALIGN;
+		memset(block, 0, bytes);
+		return block;
+	}
+
+	const size_t start = (_used + RT_ARENA_ALIGN - 1) & ~(size_t)(RT_ARENA_ALIGN - 1);
+	if (start + RT_ARENA_ALIGN + bytes > _size) {
+		pthread_mutex_unlock(&_lock);
+		return NULL;
+	}
+	_used = start + RT_ARENA_ALIGN + bytes;
+
+	Block_Header *header = reinterpret_cast<Block_Header *>(_base + start);
+	header->bytes = bytes;
+	header->next = NULL;
+	pthread_mutex_unlock(&_lock);
+
+	// fresh space has never been handed out, so it is still the kernel's zeroed pages
+	return _base + start + RT_ARENA_ALIGN;
+}
+
+void Rt_Arena::release(void *block)
+{
+	Block_Header *header = reinterpret_cast<Block_Header *>(static_cast<char *>(block) - RT_ARENA_ALIGN);
+
+	pthread_mutex_lock(&_lock);
+	header->next = _released;
+	_released = header;
+	pthread_mutex_unlock(&_lock);
+}
+
+Rt_Arena rt_arena;
+
+/** Allocate `count` zeroed elements for a DSP buffer, from the arena if one is reserved.
+ * Only for plain types like samples, whose constructors do nothing.
+ */
+template <typename T>
+T *dspAlloc(size_t count)
+{
+	void *block = rt_arena.alloc(sizeof(T) * count);
+	if (block != NULL) return static_cast<T *>(block);
+
+	if (rt_arena.size() > 0) rt_arena.addOverflow(sizeof(T) * count);
+	return new T[count]();
+}
+
+/** Free a buffer from `dspAlloc`, back to the arena or the heap, wherever it came from. */
+template <typename T>
+void dspFree(T *block)
+{
+	if (block == NULL) return;
+
+	if (rt_arena.contains(block)) rt_arena.release(block);
+	else delete[] block;
+}
+
+/** Lock every page the process has now or maps later into RAM.
+ *
+ * @return 0 on success
+ */
+int rtLockMemory(void)
+{
+	if (mlockall(MCL_CURRENT | MCL_FUTURE) != 0) {
+		rtReport(0, "mlockall failed (%s), memory can still be paged out; raise the memlock limit", strerror(errno));
+		return -1;
+	}
+	rtReport(1, "locked all current and future memory with mlockall");
+	return 0;
+}
+
+/** Keep a thread off the audio core. Threads it creates afterwards inherit this.
+ *
+ * @return 0 on success
+ */
+int rtPinAwayFromAudio(pthread_t thread, const char *name)
+{
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (cpus < 2) {
+		rtReport(0, "only one core, so the %s thread shares it with audio", name);
+		return -1;
+	}
+
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	for (long cpu = 0; cpu < cpus; cpu++) {
+		if (cpu != RT_AUDIO_CPU) CPU_SET(cpu, &set);
+	}
+	if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0) {
+		rtReport(0, "could not move the %s thread off core %d", name, RT_AUDIO_CPU);
+		return -1;
+	}
+	rtReport(1, "pinned the %s thread to cores 0-%ld except %d", name, cpus - 1, RT_AUDIO_CPU);
+	return 0;
+}
+
+/** Pin the audio thread to its core and check that it runs at real-time priority.
+ *
+ * @return 0 if the thread is SCHED_FIFO or SCHED_RR
+ */
+int rtCheckAudioThread(pthread_t thread)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET(RT_AUDIO_CPU, &set);
+	if (pthread_setaffinity_np(thread, sizeof(set), &set) == 0) {
+		rtReport(1, "pinned the audio thread to core %d", RT_AUDIO_CPU);
+	} else {
+		rtReport(0, "could not pin the audio thread to core %d", RT_AUDIO_CPU);
+	}
+
+	int policy;
+	struct sched_param param;
+	if (pthread_getschedparam(thread, &policy, &param) != 0) {
+		rtReport(0, "could not read the audio thread's scheduling policy");
+		return -1;
+	}
+	if (policy != SCHED_FIFO && policy != SCHED_RR) {
+		rtReport(0, "the audio thread is NOT real-time (policy %d); check jackd runs with -R and the rtprio limit", policy);
+		return -1;
+	}
+	rtReport(1, "the audio thread runs at %s priority %d", policy == SCHED_FIFO ? "SCHED_FIFO" : "SCHED_RR", param.sched_priority);
+	return 0;
+}
+
+/** Report how much of the arena the DSP objects used. */
+void rtReportArena(void)
+{
+	if (rt_arena.size() == 0) return;
+
+	if (rt_arena.overflow() > 0) {
+		rtReport(0, "DSP buffers needed %zu KB more than the arena, that part is locked but came from the heap", rt_arena.overflow() / 1024);
+	} else {
+		rtReport(1, "DSP buffers use %zu of %zu KB in the arena", rt_arena.used() / 1024, rt_arena.size() / 1024);
+	}
+}
+
+#endif
+
+/** @} */
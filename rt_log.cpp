@@ -0,0 +1,190 @@
+/** @file
+ * @addtogroup rtlog Real-Time Log
+ *
+ * @{
+ *
+ * @brief This file contains a logger that is safe to call from the audio thread. Details
+ * follow.
+ *
+ * `printf` can block for as long as it takes the terminal to drain, which over a slow SSH
+ * session is long enough to miss a period. Code on the audio path therefore never formats
+ * text itself. It calls `Rt_Logger::log` with a message ID and up to three numeric
+ * arguments, which copies a small fixed-size entry into a lock-free ring and returns. A
+ * background thread started with `Rt_Logger::start` pops the entries, formats them and
+ * writes them to stdout or a log file.
+ *
+ * The ring has one producer and one consumer. The producer is whichever thread owns the
+ * DSP objects: the main thread while they are set up, then the audio thread once it is
+ * started. If the ring fills up, new messages are dropped and counted rather than
+ * blocking, and the count is reported once there is room again.
+ */
+#pragma once
+
+#ifndef RT_LOG_CPP_
+#define RT_LOG_CPP_
+
+#include <stdio.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+#include <atomic>
+
+#define RT_LOG_CAPACITY 256 ///< Number of entries the log ring can hold (must be a power of two)
+#define RT_LOG_MAX_ARGS 3 ///< Maximum number of arguments per message
+
+enum Log_Message_IDs {
+	LOG_FX_NONE,
+	LOG_FX_OVERDRIVE,
+	LOG_FX_DISTORTION,
+	LOG_FX_REVERB,
+	LOG_FX_TREMOLO,
+	LOG_FX_WAH,
+	LOG_TREMOLO_LENGTH,
+	LOG_OVERDRIVE_K,
+	LOG_DELAY_SAMPLES,
+	LOG_SAMPLE_RATE,
+
+	LOG_LAST_MESSAGE
+}; ///< Messages that can be logged from the audio thread
+
+/** Format strings for each message ID. Arguments are always passed as doubles. */
+static const char *log_formats[LOG_LAST_MESSAGE] = {
+	"NOFXing\n",
+	"Now ODing\n",
+	"Now DISTing\n",
+	"Now VERBing\n",
+	"Now TREMing\n",
+	"Now WAHing\n",
+	"Set tremolo frame length to %.0f\n",
+	"Set overdrive to %f\n",
+	"Delay is %.0f samples\n",
+	"Sample rate now %.0f Hz\n",
+};
+
+/** One message waiting to be formatted. */
+struct Log_Entry
+{
+	uint32_t id;
+	double args[RT_LOG_MAX_ARGS];
+};
+
+class Rt_Logger
+{
+	public:
+		/** Queue a message for the logging thread. Safe to call from the audio thread.
+		 *
+		 * @param id Message to log, from Log_Message_IDs
+		 * @param arg0..arg2 Arguments for the message's format string
+		 */
+		void log(Log_Message_IDs id, double arg0 = 0, double arg1 = 0, double arg2 = 0);
+
+		/** Start the background thread that writes queued messages to `output`. */
+		int start(FILE *output);
+
+		/** Write out everything still queued and stop the background thread. */
+		void stop(void);
+
+		Rt_Logger();
+
+	private:
+		int drain(void);
+		static void *logThread(void *arg);
+
+		Log_Entry _entries[RT_LOG_CAPACITY];
+		FILE *_output;
+		pthread_t _thread;
+		std::atomic<int> _running;
+
+		alignas(64) std::atomic<uint32_t> _head; // written by the logging thread
+		alignas(64) std::atomic<uint32_t> _tail; // written by the producer
+		std::atomic<uint32_t> _dropped;
+};
+
+Rt_Logger rt_log; ///< The logger used by the DSP objects
+
+Rt_Logger::Rt_Logger()
+{
+	_output = stdout;
+	_running = 0;
+	_head.store(0, std::memory_order_relaxed);
+	_tail.store(0, std::memory_order_relaxed);
+	_dropped.store(0, std::memory_order_relaxed);
+}
+
+void Rt_Logger::log(Log_Message_IDs id, double arg0, double arg1, double arg2)
+{
+	uint32_t tail = _tail.load(std::memory_order_relaxed);
+	if (tail - _head.load(std::memory_order_acquire) == RT_LOG_CAPACITY) {
+		_dropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	Log_Entry &entry = _entries[tail & (RT_LOG_CAPACITY - 1)];
+	entry.id = id;
+	entry.args[0] = arg0;
+	entry.args[1] = arg1;
+	entry.args[2] = arg2;
+	_tail.store(tail + 1, std::memory_order_release);
+}
+
+int Rt_Logger::drain(void)
+{
+	uint32_t head = _head.load(std::memory_order_relaxed);
+	uint32_t tail = _tail.load(std::memory_order_acquire);
+	int count = 0;
+
+	while (head != tail) {
+		const Log_Entry &entry = _entries[head & (RT_LOG_CAPACITY - 1)];
+		if (entry.id < LOG_LAST_MESSAGE) {
+			fprintf(_output, log_formats[entry.id], entry.args[0], entry.args[1], entry.args[2]);
+		}
+		_head.store(++head, std::memory_order_release);
+		count++;
+	}
+
+	uint32_t dropped = _dropped.exchange(0, std::memory_order_relaxed);
+	if (dropped > 0) {
+		fprintf(_output, "(%u log messages dropped)\n", dropped);
+	}
+
+	if (count > 0) fflush(_output);
+	return count;
+}
+
+void *Rt_Logger::logThread(void *arg)
+{
+	Rt_Logger *logger = static_cast<Rt_Logger *>(arg);
+	const struct timespec poll = { 0, 10000000 }; // 10 ms
+
+	while (logger->_running.load(std::memory_order_acquire)) {
+		if (logger->drain() == 0) nanosleep(&poll, NULL);
+	}
+
+	logger->drain();
+	return NULL;
+}
+
+int Rt_Logger::start(FILE *output)
+{
+	_output = output;
+	_running.store(1, std::memory_order_release);
+
+	if (pthread_create(&_thread, NULL, logThread, this) != 0) {
+		_running.store(0, std::memory_order_relaxed);
+		return -1;
+	}
+	return 0;
+}
+
+void Rt_Logger::stop(void)
+{
+	if (_running.exchange(0, std::memory_order_acq_rel)) {
+		pthread_join(_thread, NULL);
+	} else {
+		drain();
+	}
+}
+
+#endif
+
+/** @} */
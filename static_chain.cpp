@@ -0,0 +1,87 @@
+/** @file
+ * @addtogroup chain FX Chain
+ *
+ * @{
+ *
+ * @brief This file contains a compile-time FX chain for pedals whose FX never change
+ * order. Details follow.
+ *
+ * `Chain<Overdrive, Wah, Tremolo>` runs the listed stages (see @ref stages "FX Stages") in
+ * order over each block. The stage types are fixed at compile time, so there is no switch
+ * and no virtual call. Every stage's `tick` inlines into one loop over the samples, and
+ * each sample goes through the whole chain in registers before it is written out. The
+ * runtime `FX_Chain` instead makes one pass over the buffer per slot.
+ *
+ * Stages are reached through `stage<N>()` to change their parameters.
+ */
+#pragma once
+
+#ifndef STATIC_CHAIN_CPP_
+#define STATIC_CHAIN_CPP_
+
+#include <stddef.h>
+#include <tuple>
+#include <utility>
+#include <jack/jack.h>
+
+#include "fx_stages.cpp"
+
+template <typename... Stages>
+class Chain
+{
+	public:
+		/** Runs a block of samples through every stage in order.
+		 *
+		 * `in` and `out` may point to the same buffer.
+		 *
+		 * @param in Pointer to the block of samples to process
+		 * @param out Pointer to where the processed samples are written
+		 * @param nframes The number of samples in the block
+		 */
+		void process(const jack_default_audio_sample_t *in, jack_default_audio_sample_t *out, jack_nframes_t nframes)
+		{
+			// work on a local copy so the stages' state can live in registers; moving keeps
+			// stages that own buffers, like the reverb, from being copied
+			std::tuple<Stages...> stages = std::move(_stages);
+			for (jack_nframes_t i = 0; i < nframes; i++) {
+				out[i] = tickAll(stages, in[i], std::index_sequence_for<Stages...>());
+			}
+			_stages = std::move(stages);
+		}
+
+		/** Recomputes every stage's coefficients for a new sampling rate. */
+		void setSampleRate(jack_nframes_t rate)
+		{
+			setRateAll(rate, std::index_sequence_for<Stages...>());
+		}
+
+		/** Returns the stage at position `N` in the chain. */
+		template <size_t N>
+		typename std::tuple_element<N, std::tuple<Stages...> >::type &stage(void)
+		{
+			return std::get<N>(_stages);
+		}
+
+	private:
+		template <size_t... N>
+		static inline float tickAll(std::tuple<Stages...> &stages, float x, std::index_sequence<N...>)
+		{
+			// braced initializers are evaluated left to right, which is chain order
+			int order[] = { 0, (x = std::get<N>(stages).tick(x), 0)... };
+			(void) order;
+			return x;
+		}
+
+		template <size_t... N>
+		void setRateAll(jack_nframes_t rate, std::index_sequence<N...>)
+		{
+			int order[] = { 0, (std::get<N>(_stages).setSampleRate(rate), 0)... };
+			(void) order;
+		}
+
+		std::tuple<Stages...> _stages;
+};
+
+#endif
+
+/** @} */
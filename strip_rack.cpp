@@ -0,0 +1,148 @@
+/** @file
+ * @addtogroup rack Strip Rack
+ *
+ * @{
+ *
+ * @brief This file contains a rack of independent channel strips, so one client can host
+ * a pedal for every musician in the room. Details follow.
+ *
+ * Each strip is a complete pedal: its own FX chain and delay buffer, with nothing shared
+ * between strips. The backend's channels are dealt out to the strips in order, so with two
+ * channels per strip, strip 0 gets channels 0 and 1, strip 1 gets channels 2 and 3, and so
+ * on.
+ *
+ * Because the strips are independent, a period's work splits cleanly by strip. When the
+ * rack is given a @ref workers "Worker Pool", each period's strips are spread over the
+ * pool's threads and the audio thread, and `process` returns once every strip is done.
+ * That keeps everything inside one JACK client, so adding a musician adds work but no
+ * extra context switches per period. Each strip is a separate allocation, so two cores
+ * working on neighbouring strips never write to the same cache line.
+ */
+#pragma once
+
+#ifndef STRIP_RACK_CPP_
+#define STRIP_RACK_CPP_
+
+#include <jack/jack.h>
+
+#include "delay_buffer.cpp"
+#include "fx_chain.cpp"
+#include "worker_pool.cpp"
+
+#define RACK_MAX_STRIPS 64 ///< Most strips a rack can hold
+
+/** One musician's pedal: an FX chain and the delay buffer that echoes through it. */
+struct Channel_Strip
+{
+	FX_Chain fx;
+	Delay_Buffer delay;
+};
+
+class Strip_Rack
+{
+	public:
+		/** Replace the rack's strips with `count` new ones.
+		 *
+		 * Every FX chain is set to `channels` channels. The delay buffers are left as
+		 * placeholders to be assigned by the caller. This allocates, so call it before
+		 * audio starts.
+		 *
+		 * @param count Number of strips, from 1 to RACK_MAX_STRIPS
+		 * @param channels Number of channels in each strip, from 1 to FX_MAX_CHANNELS
+		 */
+		void setStrips(int count, int channels);
+
+		/** Share each period's strips out over a worker pool, or NULL to run them all on
+		 * the audio thread.
+		 */
+		void setWorkers(Worker_Pool *pool) { _pool = pool; }
+
+		/** Run one period through every strip.
+		 *
+		 * @param in One pointer per channel, `strips() * channels()` in all
+		 * @param out One pointer per channel, `strips() * channels()` in all
+		 * @param nframes The number of samples in the period
+		 */
+		void process(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, jack_nframes_t nframes);
+
+		Channel_Strip &strip(int i) { return *_strips[i]; }
+		int strips(void) const { return _count; }
+		int channels(void) const { return _channels; }
+
+		Strip_Rack();
+		~Strip_Rack();
+
+		Strip_Rack(const Strip_Rack &) = delete;
+		Strip_Rack &operator=(const Strip_Rack &) = delete;
+
+	private:
+		static void processStrip(int strip, void *arg);
+
+		Channel_Strip *_strips[RACK_MAX_STRIPS];
+		int _count;
+		int _channels; // channels per strip
+		Worker_Pool *_pool;
+
+		// the period being processed, read by processStrip on every thread
+		const jack_default_audio_sample_t *const *_in;
+		jack_default_audio_sample_t *const *_out;
+		jack_nframes_t _nframes;
+};
+
+Strip_Rack::Strip_Rack()
+{
+	_count = 0;
+	_channels = 1;
+	_pool = NULL;
+	_in = NULL;
+	_out = NULL;
+	_nframes = 0;
+}
+
+Strip_Rack::~Strip_Rack()
+{
+	for (int i = 0; i < _count; i++) {
+		delete _strips[i];
+	}
+}
+
+void Strip_Rack::setStrips(int count, int channels)
+{
+	for (int i = 0; i < _count; i++) {
+		delete _strips[i];
+	}
+
+	if (count > RACK_MAX_STRIPS) count = RACK_MAX_STRIPS;
+	for (int i = 0; i < count; i++) {
+		_strips[i] = new Channel_Strip;
+		_strips[i]->fx.setChannels(channels);
+	}
+	_count = count;
+	_channels = channels;
+}
+
+void Strip_Rack::processStrip(int strip, void *arg)
+{
+	Strip_Rack *rack = static_cast<Strip_Rack *>(arg);
+	const int first = strip * rack->_channels;
+	rack->_strips[strip]->delay.newFrame(rack->_in + first, rack->_out + first, rack->_nframes);
+}
+
+void Strip_Rack::process(const jack_default_audio_sample_t *const *in, jack_default_audio_sample_t *const *out, jack_nframes_t nframes)
+{
+	_in = in;
+	_out = out;
+	_nframes = nframes;
+
+	if (_pool != NULL && _count > 1) {
+		_pool->run(processStrip, this, _count);
+	} else {
+		for (int i = 0; i < _count; i++) {
+			processStrip(i, this);
+		}
+	}
+}
+
+#endif
+
+/** @} */
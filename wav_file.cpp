@@ -0,0 +1,242 @@
+/** @file
+ * @addtogroup wav WAV File
+ *
+ * @{
+ *
+ * @brief This file contains a minimal reader and writer for RIFF/WAVE files, used to run
+ * the FX chain over recordings without a sound card. Details follow.
+ *
+ * Only uncompressed audio is handled: 8, 16, 24 and 32 bit integer PCM and 32 bit IEEE
+ * float, including the WAVE_FORMAT_EXTENSIBLE variants of those. Samples are converted
+ * to floats in the range -1 to 1 on load and stored one channel after another, so each
+ * channel is a contiguous run that can be processed in place. Files are assumed to be
+ * little-endian, which matches both the Raspberry Pi and x86.
+ */
+#pragma once
+
+#ifndef WAV_FILE_CPP_
+#define WAV_FILE_CPP_
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <jack/jack.h>
+
+#define WAV_FORMAT_PCM			0x0001 ///< Integer PCM format tag
+#define WAV_FORMAT_IEEE_FLOAT	0x0003 ///< 32 bit float format tag
+#define WAV_FORMAT_EXTENSIBLE	0xFFFE ///< Format tag whose real format is in the sub-format GUID
+
+class Wav_File
+{
+	public:
+		/** Load a WAV file into memory with a given number of channels.
+		 *
+		 * For one channel, all of the file's channels are mixed down to mono. Otherwise
+		 * channel `c` is the file's channel `c`, or its last channel if it has fewer.
+		 *
+		 * @param path Path of the file to read
+		 * @param channels Number of channels to load
+		 *
+		 * @return 0 on success, -1 if the file could not be read or is not supported
+		 */
+		int read(const char *path, int channels = 1);
+
+		/** Write the samples to a WAV file with `_channels` channels.
+		 *
+		 * @param path Path of the file to write
+		 * @param bits_per_sample 16 for integer PCM, 32 for IEEE float
+		 *
+		 * @return 0 on success, -1 if the file could not be written
+		 */
+		int write(const char *path, int bits_per_sample);
+
+		Wav_File();
+
+		/** Number of samples in each channel. */
+		size_t frames(void) const { return _samples.size() / _channels; }
+
+		/** Pointer to the first sample of a channel. */
+		jack_default_audio_sample_t *channel(int c) { return &_samples[c * frames()]; }
+
+		std::vector<jack_default_audio_sample_t> _samples; ///< Samples in the range -1 to 1, one channel after another
+		jack_nframes_t _sample_rate; ///< Sampling rate of the file in Hz
+		int _channels; ///< Number of channels in `_samples`
+
+	private:
+		static float decodeSample(const uint8_t *data, int format, int bytes);
+};
+
+Wav_File::Wav_File()
+{
+	_sample_rate = 44100;
+	_channels = 1;
+}
+
+float Wav_File::decodeSample(const uint8_t *data, int format, int bytes)
+{
+	if (format == WAV_FORMAT_IEEE_FLOAT) {
+		float value;
+		memcpy(&value, data, sizeof(value));
+		return value;
+	}
+
+	switch (bytes) {
+		case 1:
+			return (data[0] - 128) / 128.0f;
+		case 2:
+			return (int16_t)(data[0] | (data[1] << 8)) / 32768.0f;
+		case 3:
+			return (int32_t)((data[0] << 8) | (data[1] << 16) | ((uint32_t)data[2] << 24)) / 2147483648.0f;
+		case 4:
+			return (int32_t)(data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32_t)data[3] << 24)) / 2147483648.0f;
+		default:
+			return 0;
+	}
+}
+
+int Wav_File::read(const char *path, int load_channels)
+{
+	FILE *fp = fopen(path, "rb");
+	if (fp == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	uint8_t header[12];
+	if (fread(header, 1, sizeof(header), fp) != sizeof(header) ||
+		memcmp(header, "RIFF", 4) != 0 || memcmp(header + 8, "WAVE", 4) != 0) {
+		fprintf(stderr, "%s: not a RIFF/WAVE file\n", path);
+		fclose(fp);
+		return -1;
+	}
+
+	int format = 0, channels = 0, bits = 0;
+	uint8_t chunk[8];
+
+	while (fread(chunk, 1, sizeof(chunk), fp) == sizeof(chunk)) {
+		uint32_t size = chunk[4] | (chunk[5] << 8) | (chunk[6] << 16) | ((uint32_t)chunk[7] << 24);
+
+		if (memcmp(chunk, "fmt ", 4) == 0) {
+			uint8_t fmt[40] = {0};
+			uint32_t len = size < sizeof(fmt) ? size : sizeof(fmt);
+			if (size < 16 || fread(fmt, 1, len, fp) != len) break;
+
+			format = fmt[0] | (fmt[1] << 8);
+			channels = fmt[2] | (fmt[3] << 8);
+			_sample_rate = fmt[4] | (fmt[5] << 8) | (fmt[6] << 16) | ((uint32_t)fmt[7] << 24);
+			bits = fmt[14] | (fmt[15] << 8);
+
+			// the real format tag is the first two bytes of the sub-format GUID
+			if (format == WAV_FORMAT_EXTENSIBLE && len >= 26) format = fmt[24] | (fmt[25] << 8);
+
+			fseek(fp, size - len + (size & 1), SEEK_CUR);
+		} else if (memcmp(chunk, "data", 4) == 0) {
+			int bytes = bits / 8;
+			if (channels == 0 || bytes == 0 ||
+				(format != WAV_FORMAT_PCM && format != WAV_FORMAT_IEEE_FLOAT) ||
+				(format == WAV_FORMAT_IEEE_FLOAT && bits != 32) || bits > 32) {
+				fprintf(stderr, "%s: unsupported format %d with %d bits\n", path, format, bits);
+				break;
+			}
+
+			std::vector<uint8_t> data(size);
+			size = fread(data.data(), 1, size, fp);
+
+			uint32_t frame_bytes = bytes * channels;
+			uint32_t frames = size / frame_bytes;
+			_channels = load_channels;
+			_samples.assign((size_t)frames * _channels, 0);
+
+			for (uint32_t i = 0; i < frames; i++) {
+				const uint8_t *frame = &data[i * frame_bytes];
+				if (_channels == 1) {
+					float sum = 0;
+					for (int c = 0; c < channels; c++) {
+						sum += decodeSample(frame + c * bytes, format, bytes);
+					}
+					_samples[i] = sum / channels;
+				} else {
+					for (int c = 0; c < _channels; c++) {
+						int source = c < channels ? c : channels - 1;
+						_samples[(size_t)c * frames + i] = decodeSample(frame + source * bytes, format, bytes);
+					}
+				}
+			}
+
+			fclose(fp);
+			return 0;
+		} else {
+			fseek(fp, size + (size & 1), SEEK_CUR);
+		}
+	}
+
+	fprintf(stderr, "%s: no audio data found\n", path);
+	fclose(fp);
+	return -1;
+}
+
+static void putLE(uint8_t *dest, uint32_t value, int bytes)
+{
+	for (int i = 0; i < bytes; i++) {
+		dest[i] = (value >> (8 * i)) & 0xFF;
+	}
+}
+
+int Wav_File::write(const char *path, int bits_per_sample)
+{
+	int bytes = bits_per_sample / 8;
+	int format = bits_per_sample == 32 ? WAV_FORMAT_IEEE_FLOAT : WAV_FORMAT_PCM;
+	uint32_t data_size = _samples.size() * bytes;
+	size_t frame_count = frames();
+
+	FILE *fp = fopen(path, "wb");
+	if (fp == NULL) {
+		perror(path);
+		return -1;
+	}
+
+	uint8_t header[44];
+	memcpy(header, "RIFF", 4);
+	putLE(header + 4, 36 + data_size, 4);
+	memcpy(header + 8, "WAVEfmt ", 8);
+	putLE(header + 16, 16, 4);
+	putLE(header + 20, format, 2);
+	putLE(header + 22, _channels, 2);
+	putLE(header + 24, _sample_rate, 4);
+	putLE(header + 28, _sample_rate * bytes * _channels, 4);
+	putLE(header + 32, bytes * _channels, 2);
+	putLE(header + 34, bits_per_sample, 2);
+	memcpy(header + 36, "data", 4);
+	putLE(header + 40, data_size, 4);
+
+	// interleave the channels again on the way out
+	std::vector<uint8_t> data(data_size);
+	for (size_t i = 0; i < _samples.size(); i++) {
+		uint8_t *dest = &data[((i % frame_count) * _channels + i / frame_count) * bytes];
+		if (format == WAV_FORMAT_IEEE_FLOAT) {
+			memcpy(dest, &_samples[i], bytes);
+		} else {
+			float sample = _samples[i];
+			if (sample > 1.0f) sample = 1.0f;
+			else if (sample < -1.0f) sample = -1.0f;
+			putLE(dest, (uint16_t)(int16_t)lrintf(sample * 32767), 2);
+		}
+	}
+
+	int result = 0;
+	if (fwrite(header, 1, sizeof(header), fp) != sizeof(header) ||
+		fwrite(data.data(), 1, data_size, fp) != data_size) {
+		perror(path);
+		result = -1;
+	}
+
+	fclose(fp);
+	return result;
+}
+
+#endif
+
+/** @} */
@@ -0,0 +1,301 @@
+/** @file
+ * @addtogroup workers Worker Pool
+ *
+ * @{
+ *
+ * @brief This file contains a fixed pool of worker threads that the audio thread can hand
+ * a batch of independent jobs to once per period. Details follow.
+ *
+ * The threads are created once, before audio starts, and each one is pinned to its own
+ * core. `run` publishes a batch by bumping a generation counter. The workers and the
+ * calling thread then claim jobs with an atomic counter until none are left. `run` only
+ * returns once every worker has checked in for that batch, so it also works as a barrier,
+ * and the next batch can safely reuse the same job data.
+ *
+ * Waiting threads spin on the counter for a short while first. A period is short, so a
+ * worker that has just finished usually sees the next batch without ever sleeping. After
+ * that they sleep on a futex, so an idle pool costs no CPU. On a single core there is nobody
+ * to spin for, so they go straight to sleep. The futex is only woken when somebody is
+ * actually asleep, so the audio thread never makes a system call while the pool is busy.
+ */
+#pragma once
+
+#ifndef WORKER_POOL_CPP_
+#define WORKER_POOL_CPP_
+
+#include <stdio.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <atomic>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+
+#define WORKER_MAX_THREADS 16 ///< Most worker threads a pool can have
+#define WORKER_SPIN 4000 ///< Times a waiting thread polls before it sleeps
+
+/** A job handed to the pool. Called once for each item from 0 to `items` - 1. */
+typedef void (*Worker_Task)(int item, void *arg);
+
+class Worker_Pool
+{
+	public:
+		/** Create the worker threads and pin them to cores.
+		 *
+		 * Worker `i` is pinned to core `first_cpu + i`, wrapping around the online cores
+		 * from `first_cpu` up, so no worker lands on a core below it (like the audio
+		 * thread's). More workers than those cores double up, so callers should not ask
+		 * for that many.
+		 * Given a priority, each asks for it under SCHED_FIFO so it is not preempted by
+		 * ordinary threads, and prints a warning if it cannot get it.
+		 *
+		 * @param workers Number of threads, up to WORKER_MAX_THREADS (0 runs every job on the caller)
+		 * @param first_cpu Core for the first worker
+		 * @param priority SCHED_FIFO priority, which should be that of the thread calling
+		 * `run`: higher, and a spinning worker would lock that thread and the IRQ threads
+		 * out of its core. 0 leaves the workers at normal priority.
+		 *
+		 * @return 0 on success
+		 */
+		int start(int workers, int first_cpu, int priority);
+
+		/** Wake the workers so they exit, and wait for them. */
+		void stop(void);
+
+		/** Run `task` for every item, spread across the workers and the calling thread.
+		 *
+		 * Does not allocate or lock, and only makes a system call if a worker has gone to
+		 * sleep. Must only be called from one thread at a time.
+		 *
+		 * @param task Function to call for each item
+		 * @param arg Passed to every call of `task`
+		 * @param items Number of items
+		 */
+		void run(Worker_Task task, void *arg, int items);
+
+		/** Number of worker threads, not counting the caller. */
+		int workers(void) const { return _workers; }
+
+		/** Tell the CPU the calling thread is spinning on a shared variable. */
+		static inline void cpuRelax(void);
+
+		Worker_Pool();
+		~Worker_Pool();
+
+	private:
+		static void *workerThread(void *arg);
+		void work(void);
+		static void futexWait(std::atomic<int> *word, int value);
+		static void futexWake(std::atomic<int> *word);
+
+		int _workers;
+		pthread_t _threads[WORKER_MAX_THREADS];
+		int _first_cpu;
+		int _priority; // SCHED_FIFO priority, 0 for none
+		int _spin; // polls before sleeping, 0 on a single core
+
+		// the current batch, written by `run` before the generation is bumped
+		Worker_Task _task;
+		void *_arg;
+		int _items;
+
+		alignas(64) std::atomic<int> _generation; // bumped for each batch; workers sleep on it
+		std::atomic<int> _sleepers; // workers asleep on _generation
+		std::atomic<int> _running;
+		alignas(64) std::atomic<int> _next_item; // next item to claim
+		alignas(64) std::atomic<int> _pending; // workers yet to finish this batch; the caller sleeps on it
+		std::atomic<int> _caller_sleeping;
+		std::atomic<int> _next_index; // hands each new worker its number
+		std::atomic<int> _started; // workers that have pinned themselves and are ready
+};
+
+Worker_Pool::Worker_Pool()
+{
+	_workers = 0;
+	_first_cpu = 0;
+	_priority = 0;
+	_spin = WORKER_SPIN;
+	_task = NULL;
+	_arg = NULL;
+	_items = 0;
+	_generation = 0;
+	_sleepers = 0;
+	_running = 0;
+	_next_item = 0;
+	_pending = 0;
+	_caller_sleeping = 0;
+	_next_index = 0;
+	_started = 0;
+}
+
+Worker_Pool::~Worker_Pool()
+{
+	stop();
+}
+
+void Worker_Pool::futexWait(std::atomic<int> *word, int value)
+{
+	// std::atomic<int> has the same layout as int on Linux, which the futex relies on
+	syscall(SYS_futex, (int *) word, FUTEX_WAIT_PRIVATE, value, NULL, NULL, 0);
+}
+
+void Worker_Pool::futexWake(std::atomic<int> *word)
+{
+	syscall(SYS_futex, (int *) word, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+}
+
+inline void Worker_Pool::cpuRelax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__arm__) || defined(__aarch64__)
+	__asm__ __volatile__("yield");
+#endif
+}
+
+int Worker_Pool::start(int workers, int first_cpu, int priority)
+{
+	if (workers > WORKER_MAX_THREADS) workers = WORKER_MAX_THREADS;
+	_first_cpu = first_cpu;
+	_priority = priority;
+	_spin = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? WORKER_SPIN : 0;
+	_running = 1;
+
+	for (_workers = 0; _workers < workers; _workers++) {
+		if (pthread_create(&_threads[_workers], NULL, workerThread, this) != 0) {
+			printf("Could not start worker thread %d\n", _workers);
+			stop();
+			return -1;
+		}
+	}
+
+	// a worker that started late would miss the first batch, so wait until all are ready
+	while (_started.load(std::memory_order_acquire) < _workers) {
+		usleep(1000);
+	}
+	return 0;
+}
+
+void Worker_Pool::stop(void)
+{
+	if (!_running) return;
+
+	_running = 0;
+	_generation.fetch_add(1, std::memory_order_seq_cst);
+	futexWake(&_generation);
+
+	for (int i = 0; i < _workers; i++) {
+		pthread_join(_threads[i], NULL);
+	}
+	_workers = 0;
+	_next_index = 0;
+	_started = 0;
+}
+
+void Worker_Pool::work(void)
+{
+	int item;
+	while ((item = _next_item.fetch_add(1, std::memory_order_relaxed)) < _items) {
+		_task(item, _arg);
+	}
+}
+
+void Worker_Pool::run(Worker_Task task, void *arg, int items)
+{
+	if (_workers == 0) {
+		for (int i = 0; i < items; i++) {
+			task(i, arg);
+		}
+		return;
+	}
+
+	_task = task;
+	_arg = arg;
+	_items = items;
+	_next_item.store(0, std::memory_order_relaxed);
+	_pending.store(_workers, std::memory_order_relaxed);
+
+	// the release publishes the batch; seq_cst pairs with the sleepers check below
+	_generation.fetch_add(1, std::memory_order_seq_cst);
+	if (_sleepers.load(std::memory_order_seq_cst) > 0) {
+		futexWake(&_generation);
+	}
+
+	work();
+
+	// barrier: every worker has to check in before the batch can be reused
+	for (int spin = 0; _pending.load(std::memory_order_acquire) != 0; spin++) {
+		if (spin < _spin) {
+			cpuRelax();
+			continue;
+		}
+
+		int pending = _pending.load(std::memory_order_seq_cst);
+		if (pending == 0) break;
+		_caller_sleeping.store(1, std::memory_order_seq_cst);
+		if (_pending.load(std::memory_order_seq_cst) == pending) {
+			futexWait(&_pending, pending);
+		}
+		_caller_sleeping.store(0, std::memory_order_relaxed);
+	}
+}
+
+void *Worker_Pool::workerThread(void *arg)
+{
+	Worker_Pool *pool = static_cast<Worker_Pool *>(arg);
+	const int index = pool->_next_index.fetch_add(1);
+
+	// wrap over the cores from _first_cpu up, never onto the ones reserved below it
+	const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	const long spare = cpus > pool->_first_cpu ? cpus - pool->_first_cpu : 1;
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	CPU_SET((pool->_first_cpu + index % spare) % (cpus > 0 ? cpus : 1), &set);
+	if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+		printf("Warning: could not pin worker %d to a core\n", index);
+	}
+
+	struct sched_param param;
+	param.sched_priority = pool->_priority;
+	if (pool->_priority > 0 && pthread_setschedparam(pthread_self(), SCHED_FIFO, &param) != 0) {
+		printf("Warning: could not get SCHED_FIFO priority %d for worker %d\n", pool->_priority, index);
+	}
+
+	int seen = pool->_generation.load(std::memory_order_acquire);
+	pool->_started.fetch_add(1, std::memory_order_release);
+
+	while (pool->_running) {
+		int generation = pool->_generation.load(std::memory_order_acquire);
+		for (int spin = 0; spin < pool->_spin && generation == seen; spin++) {
+			cpuRelax();
+			generation = pool->_generation.load(std::memory_order_acquire);
+		}
+
+		if (generation == seen) {
+			// nothing yet, so sleep until `run` or `stop` bumps the generation
+			pool->_sleepers.fetch_add(1, std::memory_order_seq_cst);
+			if (pool->_generation.load(std::memory_order_seq_cst) == seen) {
+				futexWait(&pool->_generation, seen);
+			}
+			pool->_sleepers.fetch_sub(1, std::memory_order_relaxed);
+			continue;
+		}
+
+		seen = generation;
+		if (!pool->_running) break;
+
+		pool->work();
+
+		if (pool->_pending.fetch_sub(1, std::memory_order_seq_cst) == 1 &&
+			pool->_caller_sleeping.load(std::memory_order_seq_cst)) {
+			futexWake(&pool->_pending);
+		}
+	}
+
+	return NULL;
+}
+
+#endif
+
+/** @} */